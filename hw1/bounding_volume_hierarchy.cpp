@@ -1,6 +1,51 @@
 #include "bounding_volume_hierarchy.h"
+#include <algorithm>
+#include <chrono>
+#include "bvh_builder.h"
+#include "parser.h"
+#include "ray_packet.h"
+#include "wide_bvh.h"
+using parser::Face;
+using parser::Sphere;
 using parser::Vec3f;
 
+namespace {
+
+struct StackEntry {
+  int node;
+  float t;
+};
+
+// Spreads the lower 10 bits of v out to every third bit.
+unsigned ExpandBits(unsigned v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// Accumulates the leaf count, depth and SAH cost of the subtree at idx.
+void AddStats(const std::vector<BuildNode>& build_nodes, int idx, int depth,
+              float root_area, float traversal_cost,
+              BoundingVolumeHierarchy::Stats& stats) {
+  const BuildNode& node = build_nodes[idx];
+  const float area =
+      root_area > 0 ? node.bounding_box.GetSurfaceArea() / root_area : 0;
+  stats.max_depth = std::max(stats.max_depth, depth);
+  if (node.left == -1) {
+    stats.leaf_count++;
+    stats.sah_cost += area * (node.end - node.start);
+    return;
+  }
+  stats.sah_cost += area * traversal_cost;
+  AddStats(build_nodes, node.left, depth + 1, root_area, traversal_cost, stats);
+  AddStats(build_nodes, node.right, depth + 1, root_area, traversal_cost,
+           stats);
+}
+
+}  // namespace
+
 void BoundingBox::Expand(const BoundingBox& bounding_box) {
   min_corner.x = fmin(min_corner.x, bounding_box.min_corner.x);
   min_corner.y = fmin(min_corner.y, bounding_box.min_corner.y);
@@ -9,12 +54,20 @@ void BoundingBox::Expand(const BoundingBox& bounding_box) {
   max_corner.x = fmax(max_corner.x, bounding_box.max_corner.x);
   max_corner.y = fmax(max_corner.y, bounding_box.max_corner.y);
   max_corner.z = fmax(max_corner.z, bounding_box.max_corner.z);
+}
+
+void BoundingBox::Expand(const Vec3f& point) {
+  min_corner.x = fmin(min_corner.x, point.x);
+  min_corner.y = fmin(min_corner.y, point.y);
+  min_corner.z = fmin(min_corner.z, point.z);
 
-  delta = max_corner - min_corner;
-  center = (max_corner + min_corner) / 2.;
+  max_corner.x = fmax(max_corner.x, point.x);
+  max_corner.y = fmax(max_corner.y, point.y);
+  max_corner.z = fmax(max_corner.z, point.z);
 }
 
 int BoundingBox::GetMaxDimension() const {
+  const Vec3f delta = GetExtent();
   if (delta.x > delta.y) {
     if (delta.x > delta.z) return 0;
     return 2;
@@ -23,170 +76,654 @@ int BoundingBox::GetMaxDimension() const {
   return 2;
 }
 
-float BoundingBox::DoesIntersect(const Ray& ray) const {
-  float tnmax = -kInf;
-  float tfmin = kInf;
-  const Vec3f origin = ray.origin;
-  const Vec3f direction = ray.direction;
+float BoundingBox::DoesIntersect(const Ray& ray, float tmax) const {
+  const Vec3f* const corners[2] = {&min_corner, &max_corner};
+  float tnear = 0;
+  float tfar = tmax;
   for (int i = 0; i < 3; i++) {
-    if (fabs(direction[i]) < kEpsilon) continue;
-    float tn = (min_corner[i] - origin[i]) / direction[i];
-    float tf = (max_corner[i] - origin[i]) / direction[i];
-    if (direction[i] < 0) std::swap(tn, tf);
-    if (tn > tnmax) tnmax = tn;
-    if (tf < tfmin) tfmin = tf;
-    if (tnmax > tfmin) return kInf;
-  }
-  return tnmax;
-}
-
-Vec3f BoundingBox::GetExtent() const { return delta; }
-Vec3f BoundingBox::GetCenter() const { return center; }
-
-void BoundingVolumeHierarchy::GetIntersection(const Ray& ray, Node* cur,
-                                              HitRecord& hit_record,
-                                              const Object* hit_obj) const {
-  const int left = cur->start;
-  const int right = cur->end;
-
-  if (left + 1 == right) {
-    const Object* leaf = (*objects_)[left];
-    if (leaf == hit_obj) return;
-    const HitRecord rec = leaf->GetIntersection(ray);
-    if (rec.t < hit_record.t && rec.t > .0) {
-      hit_record = rec;
-    }
-    return;
+    const float near = ((*corners[ray.sign[i]])[i] - ray.origin[i]) *
+                       ray.inv_direction[i];
+    const float far = ((*corners[1 - ray.sign[i]])[i] - ray.origin[i]) *
+                      ray.inv_direction[i];
+    // A NaN from a ray lying in a slab plane leaves the interval unchanged.
+    tnear = near > tnear ? near : tnear;
+    tfar = far < tfar ? far : tfar;
   }
+  // Rounding may put tfar just before tnear for a ray through an edge or a
+  // flat box, which is entered all the same.
+  tfar *= BoundingVolumeHierarchy::kRobustFactor;
+  return tnear <= tfar ? tnear : kInf;
+}
 
-  float t_left = kInf;
-  float t_right = kInf;
-  if (cur->left != nullptr) {
-    const BoundingBox bounding_box = cur->left->bounding_box;
-    t_left = bounding_box.DoesIntersect(ray);
+unsigned BoundingBox::GetMortonCode(const Vec3f& point) const {
+  constexpr const int kMaxCell = (1 << kMortonBits) - 1;
+  unsigned code = 0;
+  for (int i = 0; i < 3; i++) {
+    const float extent = max_corner[i] - min_corner[i];
+    const float scale = extent > 0 ? (kMaxCell + 1) / extent : 0;
+    const int cell = (point[i] - min_corner[i]) * scale;
+    code = code << 1 | ExpandBits(std::min(kMaxCell, std::max(0, cell)));
   }
-  if (cur->right != nullptr) {
-    const BoundingBox bounding_box = cur->right->bounding_box;
-    t_right = bounding_box.DoesIntersect(ray);
+  return code;
+}
+
+TriangleArray::TriangleArray(Arena* arena)
+    : v0{ArenaVector<float>(ArenaAllocator<float>(arena)),
+         ArenaVector<float>(ArenaAllocator<float>(arena)),
+         ArenaVector<float>(ArenaAllocator<float>(arena))},
+      edge1{ArenaVector<float>(ArenaAllocator<float>(arena)),
+            ArenaVector<float>(ArenaAllocator<float>(arena)),
+            ArenaVector<float>(ArenaAllocator<float>(arena))},
+      edge2{ArenaVector<float>(ArenaAllocator<float>(arena)),
+            ArenaVector<float>(ArenaAllocator<float>(arena)),
+            ArenaVector<float>(ArenaAllocator<float>(arena))},
+      faces(ArenaAllocator<const Face*>(arena)),
+      ids(ArenaAllocator<int>(arena)) {}
+
+void TriangleArray::Reserve(int count) {
+  // AddPadding adds 7 more.
+  for (int i = 0; i < 3; i++) {
+    v0[i].reserve(count + 7);
+    edge1[i].reserve(count + 7);
+    edge2[i].reserve(count + 7);
   }
-  if (t_left < t_right) {
-    if (t_left < hit_record.t) {
-      GetIntersection(ray, cur->left, hit_record, hit_obj);
-    }
-    if (t_right < hit_record.t) {
-      GetIntersection(ray, cur->right, hit_record, hit_obj);
-    }
-  } else {
-    if (t_right < hit_record.t) {
-      GetIntersection(ray, cur->right, hit_record, hit_obj);
-    }
-    if (t_left < hit_record.t) {
-      GetIntersection(ray, cur->left, hit_record, hit_obj);
+  faces.reserve(count);
+  ids.reserve(count + 7);
+}
+
+void TriangleArray::Add(const Face& face, int id) {
+  for (int i = 0; i < 3; i++) {
+    v0[i].push_back(face.v0[i]);
+    edge1[i].push_back(face.v1[i] - face.v0[i]);
+    edge2[i].push_back(face.v2[i] - face.v0[i]);
+  }
+  faces.push_back(&face);
+  ids.push_back(id);
+}
+
+void TriangleArray::AddPadding() {
+  for (int i = 0; i < 7; i++) {
+    for (int j = 0; j < 3; j++) {
+      v0[j].push_back(0);
+      edge1[j].push_back(0);
+      edge2[j].push_back(0);
     }
+    ids.push_back(-1);
   }
 }
 
-void BoundingVolumeHierarchy::GetIntersection(const Ray& ray, Node* cur,
-                                              float tmax, float& tmin,
-                                              const Object* hit_obj) const {
-  const int left = cur->start;
-  const int right = cur->end;
-  if (tmin < tmax + kEpsilon) return;
+float TriangleArray::GetDistance(int i, const Ray& ray) const {
+  float beta, gama;
+  return IntersectTriangle(Vec3f(v0[0][i], v0[1][i], v0[2][i]),
+                           Vec3f(edge1[0][i], edge1[1][i], edge1[2][i]),
+                           Vec3f(edge2[0][i], edge2[1][i], edge2[2][i]), ray,
+                           beta, gama);
+}
 
-  if (left + 1 == right) {
-    const Object* leaf = (*objects_)[left];
-    if (leaf == hit_obj) return;
-    const HitRecord rec = leaf->GetIntersection(ray);
-    if (rec.t < tmin && rec.t > .0) {
-      tmin = rec.t;
-    }
-    return;
+namespace {
+
+// Largest finite distance, a lane with an infinite one is not a hit.
+constexpr const float kMaxDistance = std::numeric_limits<float>::max();
+
+// Vec3f::CrossProduct and the dot product of vectors of 4 or 8 lanes.
+void Cross(const __m128* a, const __m128* b, __m128* c) {
+  c[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+  c[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+  c[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+}
+
+__m128 Dot(const __m128* a, const __m128* b) {
+  return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])),
+                    _mm_mul_ps(a[2], b[2]));
+}
+
+__attribute__((target("avx2"))) void Cross(const __m256* a, const __m256* b,
+                                           __m256* c) {
+  c[0] = _mm256_sub_ps(_mm256_mul_ps(a[1], b[2]), _mm256_mul_ps(a[2], b[1]));
+  c[1] = _mm256_sub_ps(_mm256_mul_ps(a[2], b[0]), _mm256_mul_ps(a[0], b[2]));
+  c[2] = _mm256_sub_ps(_mm256_mul_ps(a[0], b[1]), _mm256_mul_ps(a[1], b[0]));
+}
+
+__attribute__((target("avx2"))) __m256 Dot(const __m256* a, const __m256* b) {
+  return _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(a[0], b[0]), _mm256_mul_ps(a[1], b[1])),
+      _mm256_mul_ps(a[2], b[2]));
+}
+
+}  // namespace
+
+// IntersectTriangle for every lane, with the operations in the same order so
+// that the distances are exactly the ones GetDistance computes.
+int TriangleArray::GetClosest4(int first, int count, const Ray& ray,
+                               int hit_id, float tmax, float* t) const {
+  __m128 d[3], e1[3], e2[3], s[3];
+  for (int j = 0; j < 3; j++) {
+    d[j] = _mm_set1_ps(ray.direction[j]);
+    e1[j] = _mm_loadu_ps(&edge1[j][first]);
+    e2[j] = _mm_loadu_ps(&edge2[j][first]);
+    s[j] = _mm_sub_ps(_mm_set1_ps(ray.origin[j]), _mm_loadu_ps(&v0[j][first]));
   }
+  __m128 p[3], q[3];
+  Cross(d, e2, p);
+  const __m128 det = Dot(e1, p);
+  const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+  const __m128 beta = _mm_mul_ps(Dot(s, p), inv_det);
+  Cross(s, e1, q);
+  const __m128 gama = _mm_mul_ps(Dot(d, q), inv_det);
+  const __m128 distance = _mm_mul_ps(Dot(e2, q), inv_det);
 
-  float t_left = kInf;
-  float t_right = kInf;
-  if (cur->left != nullptr) {
-    const BoundingBox bounding_box = cur->left->bounding_box;
-    t_left = bounding_box.DoesIntersect(ray);
+  const __m128 epsilon = _mm_set1_ps(-kBarycentricEpsilon);
+  const __m128 one = _mm_set1_ps(1.0f + kBarycentricEpsilon);
+  __m128 miss = _mm_or_ps(_mm_cmplt_ps(beta, epsilon),
+                          _mm_cmplt_ps(gama, epsilon));
+  miss = _mm_or_ps(miss, _mm_cmpgt_ps(_mm_add_ps(beta, gama), one));
+  if (!ray.is_shadow) {
+    miss = _mm_or_ps(miss, _mm_cmplt_ps(det, _mm_setzero_ps()));
   }
-  if (cur->right != nullptr) {
-    const BoundingBox bounding_box = cur->right->bounding_box;
-    t_right = bounding_box.DoesIntersect(ray);
+  const __m128 limit = _mm_set1_ps(std::min(tmax, kMaxDistance));
+  const __m128 hit = _mm_and_ps(_mm_cmpgt_ps(distance, _mm_setzero_ps()),
+                                _mm_cmple_ps(distance, limit));
+  const __m128i excluded = _mm_cmpeq_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(&ids[first])),
+      _mm_set1_epi32(hit_id));
+  const int mask = _mm_movemask_ps(_mm_andnot_ps(miss, hit)) &
+                   ~_mm_movemask_ps(_mm_castsi128_ps(excluded)) &
+                   ((1 << count) - 1);
+  if (mask == 0) return 0;
+
+  // Horizontal minimum of the distances of the lanes hit.
+  const __m128 lanes = _mm_castsi128_ps(_mm_setr_epi32(
+      mask & 1 ? -1 : 0, mask & 2 ? -1 : 0, mask & 4 ? -1 : 0,
+      mask & 8 ? -1 : 0));
+  const __m128 masked = _mm_or_ps(_mm_and_ps(lanes, distance),
+                                  _mm_andnot_ps(lanes, _mm_set1_ps(kInf)));
+  __m128 min = _mm_min_ps(masked, _mm_shuffle_ps(masked, masked, 0xb1));
+  min = _mm_min_ps(min, _mm_shuffle_ps(min, min, 0x4e));
+  *t = _mm_cvtss_f32(min);
+  return _mm_movemask_ps(_mm_cmpeq_ps(masked, min)) & mask;
+}
+
+int TriangleArray::GetClosest8(int first, int count, const Ray& ray,
+                               int hit_id, float tmax, float* t) const {
+  __m256 d[3], e1[3], e2[3], s[3];
+  for (int j = 0; j < 3; j++) {
+    d[j] = _mm256_set1_ps(ray.direction[j]);
+    e1[j] = _mm256_loadu_ps(&edge1[j][first]);
+    e2[j] = _mm256_loadu_ps(&edge2[j][first]);
+    s[j] = _mm256_sub_ps(_mm256_set1_ps(ray.origin[j]),
+                         _mm256_loadu_ps(&v0[j][first]));
   }
-  if (t_left < t_right) {
-    if (t_left < tmin) {
-      GetIntersection(ray, cur->left, tmax, tmin, hit_obj);
+  __m256 p[3], q[3];
+  Cross(d, e2, p);
+  const __m256 det = Dot(e1, p);
+  const __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+  const __m256 beta = _mm256_mul_ps(Dot(s, p), inv_det);
+  Cross(s, e1, q);
+  const __m256 gama = _mm256_mul_ps(Dot(d, q), inv_det);
+  const __m256 distance = _mm256_mul_ps(Dot(e2, q), inv_det);
+
+  const __m256 epsilon = _mm256_set1_ps(-kBarycentricEpsilon);
+  const __m256 one = _mm256_set1_ps(1.0f + kBarycentricEpsilon);
+  __m256 miss = _mm256_or_ps(_mm256_cmp_ps(beta, epsilon, _CMP_LT_OQ),
+                             _mm256_cmp_ps(gama, epsilon, _CMP_LT_OQ));
+  miss = _mm256_or_ps(
+      miss, _mm256_cmp_ps(_mm256_add_ps(beta, gama), one, _CMP_GT_OQ));
+  if (!ray.is_shadow) {
+    miss = _mm256_or_ps(
+        miss, _mm256_cmp_ps(det, _mm256_setzero_ps(), _CMP_LT_OQ));
+  }
+  const __m256 hit = _mm256_and_ps(
+      _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_GT_OQ),
+      _mm256_cmp_ps(distance, _mm256_set1_ps(std::min(tmax, kMaxDistance)),
+                    _CMP_LE_OQ));
+  const __m256i excluded = _mm256_cmpeq_epi32(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&ids[first])),
+      _mm256_set1_epi32(hit_id));
+  const int mask = _mm256_movemask_ps(_mm256_andnot_ps(miss, hit)) &
+                   ~_mm256_movemask_ps(_mm256_castsi256_ps(excluded)) &
+                   ((1 << count) - 1);
+  if (mask == 0) return 0;
+
+  const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 lanes = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+      _mm256_and_si256(_mm256_set1_epi32(mask), bits), bits));
+  const __m256 masked =
+      _mm256_blendv_ps(_mm256_set1_ps(kInf), distance, lanes);
+  __m256 min = _mm256_min_ps(masked, _mm256_permute2f128_ps(masked, masked, 1));
+  min = _mm256_min_ps(min, _mm256_shuffle_ps(min, min, 0x4e));
+  min = _mm256_min_ps(min, _mm256_shuffle_ps(min, min, 0xb1));
+  *t = _mm256_cvtss_f32(min);
+  return _mm256_movemask_ps(_mm256_cmp_ps(masked, min, _CMP_EQ_OQ)) & mask;
+}
+
+SphereArray::SphereArray(Arena* arena)
+    : center{ArenaVector<float>(ArenaAllocator<float>(arena)),
+             ArenaVector<float>(ArenaAllocator<float>(arena)),
+             ArenaVector<float>(ArenaAllocator<float>(arena))},
+      radius(ArenaAllocator<float>(arena)),
+      spheres(ArenaAllocator<const Sphere*>(arena)),
+      ids(ArenaAllocator<int>(arena)) {}
+
+void SphereArray::Reserve(int count) {
+  for (int i = 0; i < 3; i++) center[i].reserve(count);
+  radius.reserve(count);
+  spheres.reserve(count);
+  ids.reserve(count);
+}
+
+void SphereArray::Add(const Sphere& sphere, int id) {
+  for (int i = 0; i < 3; i++) {
+    center[i].push_back(sphere.center_of_sphere[i]);
+  }
+  radius.push_back(sphere.radius);
+  spheres.push_back(&sphere);
+  ids.push_back(id);
+}
+
+float SphereArray::GetDistance(int i, const Ray& ray) const {
+  const Vec3f sphere_to_camera =
+      ray.origin - Vec3f(center[0][i], center[1][i], center[2][i]);
+  const float direction_times_sphere_to_camera =
+      ray.direction * sphere_to_camera;
+  const float norm_of_sphere_to_camera_squared =
+      sphere_to_camera * sphere_to_camera;
+  const float radius_squared = radius[i] * radius[i];
+  const float determinant =
+      direction_times_sphere_to_camera * direction_times_sphere_to_camera -
+      (norm_of_sphere_to_camera_squared - radius_squared);
+  if (determinant < -kEpsilon) {
+    return kInf;
+  } else if (determinant < kEpsilon) {
+    return -direction_times_sphere_to_camera;
+  }
+  const float t1 = (-direction_times_sphere_to_camera + sqrt(determinant));
+  const float t2 = (-direction_times_sphere_to_camera - sqrt(determinant));
+  return fmin(t1, t2);
+}
+
+Vec3f BoundingBox::GetExtent() const { return max_corner - min_corner; }
+Vec3f BoundingBox::GetCenter() const { return (max_corner + min_corner) / 2.; }
+
+float BoundingBox::GetSurfaceArea() const {
+  const Vec3f delta = GetExtent();
+  if (delta.x < 0 || delta.y < 0 || delta.z < 0) return 0;
+  return 2 * (delta.x * delta.y + delta.y * delta.z + delta.z * delta.x);
+}
+
+// Children are visited nearest first, or for kAnyHit in the order the ray
+// direction goes along the split axis, which saves comparing their distances.
+template <bool kAnyHit, typename LeafFunction>
+void BoundingVolumeHierarchy::Traverse(const Ray& ray, const float& tmax,
+                                       LeafFunction intersect_leaf) const {
+  StackEntry stack[kMaxDepth];
+  int stack_size = 0;
+  int cur = 0;
+  if (nodes_[cur].bounding_box.DoesIntersect(ray, tmax * kRobustFactor) ==
+      kInf) {
+    return;
+  }
+
+  while (true) {
+    const LinearNode& node = nodes_[cur];
+    if (node.primitive_count > 0) {
+      if (intersect_leaf(node.primitive_type, node.offset,
+                         node.primitive_count)) {
+        return;
+      }
+    } else {
+      int near = cur + 1;
+      int far = node.offset;
+      const float limit = tmax * kRobustFactor;
+      float t_near = nodes_[near].bounding_box.DoesIntersect(ray, limit);
+      float t_far = nodes_[far].bounding_box.DoesIntersect(ray, limit);
+      if (kAnyHit ? ray.sign[node.axis] : t_near >= t_far) {
+        std::swap(near, far);
+        std::swap(t_near, t_far);
+      }
+      if (t_near != kInf) {
+        if (t_far != kInf) stack[stack_size++] = {far, t_far};
+        cur = near;
+        continue;
+      }
+      if (kAnyHit && t_far != kInf) {
+        cur = far;
+        continue;
+      }
     }
-    if (t_right < tmin) {
-      GetIntersection(ray, cur->right, tmax, tmin, hit_obj);
+
+    // Pop the next subtree that may still contain a closer hit.
+    while (stack_size > 0 &&
+           stack[stack_size - 1].t > tmax * kRobustFactor) {
+      stack_size--;
     }
-  } else {
-    if (t_right < tmin) {
-      GetIntersection(ray, cur->right, tmax, tmin, hit_obj);
+    if (stack_size == 0) break;
+    cur = stack[--stack_size].node;
+  }
+}
+
+int BoundingVolumeHierarchy::GetClosestTriangles(int first, int count,
+                                                 const Ray& ray, int hit_id,
+                                                 float tmax, float* t) const {
+  return triangle_width_ == 8
+             ? triangles_.GetClosest8(first, count, ray, hit_id, tmax, t)
+             : triangles_.GetClosest4(first, count, ray, hit_id, tmax, t);
+}
+
+void BoundingVolumeHierarchy::IntersectLeaf(int type, int first, int count,
+                                            const Ray& ray, int hit_id,
+                                            Hit& hit) const {
+  if (type == TRIANGLE && triangle_width_ > 1) {
+    for (int i = first; i < first + count; i += triangle_width_) {
+      float t;
+      int mask = GetClosestTriangles(
+          i, std::min(triangle_width_, first + count - i), ray, hit_id, hit.t,
+          &t);
+      if (mask == 0) continue;
+      int closest = i + __builtin_ctz(mask);
+      for (mask &= mask - 1; mask != 0; mask &= mask - 1) {
+        const int j = i + __builtin_ctz(mask);
+        if (triangles_.ids[j] < triangles_.ids[closest]) closest = j;
+      }
+      // t is at most hit.t, so the same tie break as below.
+      if (t < hit.t || triangles_.ids[closest] < hit.primitive_id) {
+        hit = {t, triangles_.ids[closest], TRIANGLE, closest};
+      }
+    }
+  } else if (type == TRIANGLE) {
+    for (int i = first; i < first + count; i++) {
+      if (triangles_.ids[i] == hit_id) continue;
+      const float t = triangles_.GetDistance(i, ray);
+      if (t > .0 && (t < hit.t || (t == hit.t &&
+                                   triangles_.ids[i] < hit.primitive_id))) {
+        hit = {t, triangles_.ids[i], TRIANGLE, i};
+      }
     }
-    if (t_left < tmin) {
-      GetIntersection(ray, cur->left, tmax, tmin, hit_obj);
+  } else {
+    for (int i = first; i < first + count; i++) {
+      if (spheres_.ids[i] == hit_id) continue;
+      const float t = spheres_.GetDistance(i, ray);
+      if (t > .0 && (t < hit.t || (t == hit.t &&
+                                   spheres_.ids[i] < hit.primitive_id))) {
+        hit = {t, spheres_.ids[i], SPHERE, i};
+      }
     }
   }
 }
 
-HitRecord BoundingVolumeHierarchy::GetIntersection(
-    const Ray& ray, const Object* hit_obj) const {
+HitRecord BoundingVolumeHierarchy::GetHitRecord(const Ray& ray,
+                                                const Hit& hit) const {
   HitRecord hit_record;
-  hit_record.t = kInf;
-  hit_record.material_id = -1;
-  const BoundingBox bounding_box = tree_->bounding_box;
-  const float t = bounding_box.DoesIntersect(ray);
-  if (t < kInf) GetIntersection(ray, tree_, hit_record, hit_obj);
+  if (hit.primitive_id == -1) {
+    hit_record.t = hit.t;
+    hit_record.material_id = -1;
+  } else if (hit.type == TRIANGLE) {
+    hit_record = triangles_.faces[hit.index]->GetIntersection(ray);
+  } else {
+    hit_record = spheres_.spheres[hit.index]->GetIntersection(ray);
+  }
+  hit_record.primitive_id = hit.primitive_id;
   return hit_record;
 }
 
-bool BoundingVolumeHierarchy::GetIntersection(const Ray& ray, float tmax,
-                                              const Object* hit_obj) const {
-  float tmin = kInf;
-  const BoundingBox bounding_box = tree_->bounding_box;
-  const float t = bounding_box.DoesIntersect(ray);
-  if (t < kInf) GetIntersection(ray, tree_, tmax, tmin, hit_obj);
-  return tmin < tmax + kEpsilon && tmin > .0;
+HitRecord BoundingVolumeHierarchy::GetIntersection(const Ray& ray,
+                                                   int hit_id) const {
+  Hit hit;
+  hit.t = kInf;
+  hit.primitive_id = -1;
+  auto intersect_leaf = [&](int type, int first, int count) {
+    IntersectLeaf(type, first, count, ray, hit_id, hit);
+    return false;
+  };
+
+  switch (node_width_) {
+    case 8:
+      if (quantized_nodes8_ != nullptr) {
+        TraverseBvh8<false>(quantized_nodes8_, SlabRay(ray), hit.t,
+                            intersect_leaf);
+      } else {
+        TraverseBvh8<false>(nodes8_, SlabRay(ray), hit.t, intersect_leaf);
+      }
+      break;
+    case 4:
+      if (quantized_nodes4_ != nullptr) {
+        TraverseBvh4<false>(quantized_nodes4_, SlabRay(ray), hit.t,
+                            intersect_leaf);
+      } else {
+        TraverseBvh4<false>(nodes4_, SlabRay(ray), hit.t, intersect_leaf);
+      }
+      break;
+    default:
+      Traverse<false>(ray, hit.t, intersect_leaf);
+  }
+  return GetHitRecord(ray, hit);
+}
+
+void BoundingVolumeHierarchy::GetIntersections(const Ray* rays, int count,
+                                               HitRecord* hit_records) const {
+  PacketFrustum frustum;
+  if (node_width_ == 2 || !frustum.Init(rays, count)) {
+    for (int i = 0; i < count; i++) {
+      hit_records[i] = GetIntersection(rays[i], -1);
+    }
+    return;
+  }
+  SlabRay slab_rays[kMaxPacketSize];
+  float tmax[kMaxPacketSize];
+  Hit hits[kMaxPacketSize];
+  for (int i = 0; i < count; i++) {
+    slab_rays[i] = SlabRay(rays[i]);
+    tmax[i] = kInf;
+    hits[i].t = kInf;
+    hits[i].primitive_id = -1;
+  }
+  auto intersect_leaf = [&](int type, int first, int primitive_count,
+                            uint64_t mask) {
+    for (; mask != 0; mask &= mask - 1) {
+      const int i = __builtin_ctzll(mask);
+      IntersectLeaf(type, first, primitive_count, rays[i], -1, hits[i]);
+      tmax[i] = hits[i].t;
+    }
+  };
+
+  if (quantized_nodes8_ != nullptr) {
+    TraversePacket8(quantized_nodes8_, frustum, slab_rays, count, tmax,
+                    intersect_leaf);
+  } else if (quantized_nodes4_ != nullptr) {
+    TraversePacket4(quantized_nodes4_, frustum, slab_rays, count, tmax,
+                    intersect_leaf);
+  } else if (node_width_ == 8) {
+    TraversePacket8(nodes8_, frustum, slab_rays, count, tmax, intersect_leaf);
+  } else {
+    TraversePacket4(nodes4_, frustum, slab_rays, count, tmax, intersect_leaf);
+  }
+  for (int i = 0; i < count; i++) {
+    hit_records[i] = GetHitRecord(rays[i], hits[i]);
+  }
 }
 
-void BoundingVolumeHierarchy::build(Node* cur, int left, int right) {
-  cur->left = nullptr;
-  cur->right = nullptr;
-  cur->start = left;
-  cur->end = right;
-  for (int i = left; i < right; i++) {
-    cur->bounding_box.Expand((*objects_)[i]->GetBoundingBox());
+bool BoundingVolumeHierarchy::Occluded(const Ray& ray, float tmax,
+                                       int hit_id) const {
+  const float t_limit = tmax + kEpsilon;
+  bool occluded = false;
+  auto intersect_leaf = [&](int type, int first, int count) {
+    if (type == TRIANGLE && triangle_width_ > 1) {
+      for (int i = first; i < first + count; i += triangle_width_) {
+        float t;
+        if (GetClosestTriangles(i, std::min(triangle_width_, first + count - i),
+                                ray, hit_id, t_limit, &t) != 0 &&
+            t < t_limit) {
+          occluded = true;
+          return true;
+        }
+      }
+      return false;
+    }
+    for (int i = first; i < first + count; i++) {
+      float t;
+      if (type == TRIANGLE) {
+        if (triangles_.ids[i] == hit_id) continue;
+        t = triangles_.GetDistance(i, ray);
+      } else {
+        if (spheres_.ids[i] == hit_id) continue;
+        t = spheres_.GetDistance(i, ray);
+      }
+      if (t < t_limit && t > .0) {
+        occluded = true;
+        return true;
+      }
+    }
+    return false;
+  };
+
+  switch (node_width_) {
+    case 8:
+      if (quantized_nodes8_ != nullptr) {
+        TraverseBvh8<true>(quantized_nodes8_, SlabRay(ray), t_limit,
+                           intersect_leaf);
+      } else {
+        TraverseBvh8<true>(nodes8_, SlabRay(ray), t_limit, intersect_leaf);
+      }
+      break;
+    case 4:
+      if (quantized_nodes4_ != nullptr) {
+        TraverseBvh4<true>(quantized_nodes4_, SlabRay(ray), t_limit,
+                           intersect_leaf);
+      } else {
+        TraverseBvh4<true>(nodes4_, SlabRay(ray), t_limit, intersect_leaf);
+      }
+      break;
+    default:
+      Traverse<true>(ray, t_limit, intersect_leaf);
   }
+  return occluded;
+}
 
-  if (left + 1 >= right) return;
+int BoundingVolumeHierarchy::Flatten(const std::vector<BuildNode>& build_nodes,
+                                     int idx, int& offset) {
+  const BuildNode& build_node = build_nodes[idx];
+  const int cur = offset++;
+  LinearNode& node = nodes_[cur];
+  node.bounding_box = build_node.bounding_box;
+  node.axis = build_node.axis;
+  node.primitive_type = build_node.primitive_type;
+  if (build_node.left == -1) {
+    node.offset = build_node.start;
+    node.primitive_count = build_node.end - build_node.start;
+  } else {
+    node.primitive_count = 0;
+    Flatten(build_nodes, build_node.left, offset);
+    node.offset = Flatten(build_nodes, build_node.right, offset);
+  }
+  return cur;
+}
 
-  const int max_dimension = cur->bounding_box.GetMaxDimension();
-  const float mean = cur->bounding_box.GetExtent()[max_dimension] / 2.;
+BoundingVolumeHierarchy::BoundingVolumeHierarchy(
+    const std::vector<const Face*>& faces,
+    const std::vector<const Sphere*>& spheres, Arena* arena,
+    const BuildOptions& options)
+    : triangles_(arena),
+      spheres_(arena),
+      options_(options),
+      stats_(),
+      nodes_(nullptr),
+      nodes4_(nullptr),
+      nodes8_(nullptr),
+      quantized_nodes4_(nullptr),
+      quantized_nodes8_(nullptr) {
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<BuildPrimitive> primitives;
+  primitives.reserve(faces.size() + spheres.size());
+  auto add_primitive = [&primitives](const BoundingBox& bounding_box,
+                                     PrimitiveType type, int index) {
+    BuildPrimitive primitive;
+    primitive.bounding_box = bounding_box;
+    primitive.center = primitive.bounding_box.GetCenter();
+    primitive.type = type;
+    primitive.index = index;
+    primitive.face = nullptr;
+    primitives.push_back(primitive);
+  };
+  for (size_t i = 0; i < faces.size(); i++) {
+    add_primitive(faces[i]->GetBoundingBox(), TRIANGLE, i);
+    primitives.back().face = faces[i];
+  }
+  for (size_t i = 0; i < spheres.size(); i++) {
+    add_primitive(spheres[i]->GetBoundingBox(), SPHERE, i);
+  }
 
-  int mid_idx = left;
-  for (int i = left; i < right; i++) {
-    const Object* obj = (*objects_)[i];
-    if (obj->GetBoundingBox().GetCenter()[max_dimension] < mean) {
-      std::swap((*objects_)[i], (*objects_)[mid_idx++]);
+  std::vector<BuildNode> build_nodes = BvhBuilder(options_).Build(primitives);
+  // Store the primitives of every type in leaf order and make the leaves
+  // refer to positions in the array of their type.
+  std::vector<int> offsets(primitives.size());
+  int counts[2] = {0, 0};
+  for (const BuildPrimitive& primitive : primitives) counts[primitive.type]++;
+  triangles_.Reserve(counts[TRIANGLE]);
+  spheres_.Reserve(counts[SPHERE]);
+  for (size_t i = 0; i < primitives.size(); i++) {
+    const BuildPrimitive& primitive = primitives[i];
+    if (primitive.type == TRIANGLE) {
+      offsets[i] = triangles_.faces.size();
+      triangles_.Add(*faces[primitive.index], primitive.index);
+    } else {
+      offsets[i] = spheres_.spheres.size();
+      spheres_.Add(*spheres[primitive.index], faces.size() + primitive.index);
     }
   }
-  if (mid_idx == left || mid_idx == right) {
-    mid_idx = (left + right) / 2;
+  triangles_.AddPadding();
+  for (BuildNode& node : build_nodes) {
+    if (node.left != -1 || node.start == node.end) continue;
+    node.end = offsets[node.start] + node.end - node.start;
+    node.start = offsets[node.start];
   }
 
-  if (left < mid_idx) {
-    cur->left = new Node;
-    build(cur->left, left, mid_idx);
+  triangle_width_ = options_.triangle_width;
+  if (triangle_width_ == 0 || triangle_width_ > GetNativeNodeWidth()) {
+    triangle_width_ = GetNativeNodeWidth();
+  } else if (triangle_width_ < 8) {
+    triangle_width_ = triangle_width_ < 4 ? 1 : 4;
   }
-  if (mid_idx < right) {
-    cur->right = new Node;
-    build(cur->right, mid_idx, right);
+  node_width_ = options_.node_width;
+  if (node_width_ == 0 || node_width_ > GetNativeNodeWidth()) {
+    node_width_ = GetNativeNodeWidth();
   }
-}
+  if (node_width_ == 8) {
+    stats_.node_count = CountWideNodes<8>(build_nodes);
+    if (options_.quantize_nodes) {
+      quantized_nodes8_ =
+          arena->AllocateArray<QuantizedWideNode<8>>(stats_.node_count);
+      CollapseTree(build_nodes, quantized_nodes8_);
+      stats_.node_bytes = stats_.node_count * sizeof(QuantizedWideNode<8>);
+    } else {
+      nodes8_ = arena->AllocateArray<WideNode<8>>(stats_.node_count);
+      CollapseTree(build_nodes, nodes8_);
+      stats_.node_bytes = stats_.node_count * sizeof(WideNode<8>);
+    }
+  } else if (node_width_ == 4) {
+    stats_.node_count = CountWideNodes<4>(build_nodes);
+    if (options_.quantize_nodes) {
+      quantized_nodes4_ =
+          arena->AllocateArray<QuantizedWideNode<4>>(stats_.node_count);
+      CollapseTree(build_nodes, quantized_nodes4_);
+      stats_.node_bytes = stats_.node_count * sizeof(QuantizedWideNode<4>);
+    } else {
+      nodes4_ = arena->AllocateArray<WideNode<4>>(stats_.node_count);
+      CollapseTree(build_nodes, nodes4_);
+      stats_.node_bytes = stats_.node_count * sizeof(WideNode<4>);
+    }
+  } else {
+    node_width_ = 2;
+    stats_.node_count = build_nodes.size();
+    nodes_ = arena->AllocateArray<LinearNode>(stats_.node_count);
+    int offset = 0;
+    Flatten(build_nodes, 0, offset);
+    stats_.node_bytes = stats_.node_count * sizeof(LinearNode);
+  }
+  const auto end = std::chrono::steady_clock::now();
+  stats_.build_time_ms =
+      std::chrono::duration<double, std::milli>(end - start).count();
+  stats_.node_width = node_width_;
+  stats_.reference_count = primitives.size();
 
-BoundingVolumeHierarchy::BoundingVolumeHierarchy(std::vector<Object*>* objects)
-    : objects_(objects) {
-  tree_ = new Node;
-  build(tree_, 0, objects_->size());
+  const float root_area = build_nodes[0].bounding_box.GetSurfaceArea();
+  AddStats(build_nodes, 0, 0, root_area, options_.traversal_cost, stats_);
 }
@@ -1,21 +1,83 @@
 #ifndef _BOUNDING_VOLUME_HIERARCHY_
 #define _BOUNDING_VOLUME_HIERARCHY_
 
+#include <string>
+#include "arena.h"
+#include "thread_pool.h"
 #include "vector.h"
 
 struct Ray {
+  Ray(const parser::Vec3f& origin, const parser::Vec3f& direction,
+      bool is_shadow)
+      : origin(origin),
+        direction(direction),
+        inv_direction(1.f / direction.x, 1.f / direction.y,
+                      1.f / direction.z),
+        is_shadow(is_shadow) {
+    for (int i = 0; i < 3; i++) sign[i] = inv_direction[i] < 0;
+  }
+
   parser::Vec3f origin;
   parser::Vec3f direction;
+  // Infinite along the axes the ray is parallel to, -0 counts as negative.
+  parser::Vec3f inv_direction;
+  // Whether the ray goes towards decreasing coordinates along each axis.
+  int sign[3];
   bool is_shadow;
 };
 
+// Barycentric coordinates are accepted this far outside of a triangle. Their
+// rounding grows with the distance to the ray origin over the size of the
+// triangle, up to 8e-5 for primary rays on the meshes of the sample scenes,
+// and a ray through an edge shared by two triangles is not to miss both.
+constexpr const float kBarycentricEpsilon = 1e-4;
+
+// Distance along the ray to the triangle v0, v0 + edge1, v0 + edge2 or kInf
+// if it misses it, Moller-Trumbore with the edges precomputed. beta and gama
+// are the barycentric coordinates of the hit, which are tested before the
+// distance is computed. Triangles facing away are missed by all but shadow
+// rays.
+inline float IntersectTriangle(const parser::Vec3f& v0,
+                               const parser::Vec3f& edge1,
+                               const parser::Vec3f& edge2, const Ray& ray,
+                               float& beta, float& gama) {
+  const parser::Vec3f p = ray.direction.CrossProduct(edge2);
+  const float det = edge1 * p;
+  if (!ray.is_shadow && det < 0) return kInf;
+  const float inv_det = 1 / det;
+  const parser::Vec3f s = ray.origin - v0;
+  beta = (s * p) * inv_det;
+  if (beta < -kBarycentricEpsilon) return kInf;
+  const parser::Vec3f q = s.CrossProduct(edge1);
+  gama = (ray.direction * q) * inv_det;
+  if (gama < -kBarycentricEpsilon || beta + gama > 1 + kBarycentricEpsilon) {
+    return kInf;
+  }
+  const float t = (edge2 * q) * inv_det;
+  return t > -kEpsilon ? t : kInf;
+}
+
 class Object;
 
 struct HitRecord {
   int material_id;
   float t;
   parser::Vec3f normal;
-  const Object* obj;
+  // Identifies the primitive hit within the BoundingVolumeHierarchy.
+  int primitive_id;
+};
+
+// Closest hit found while traversing, which only locates the primitive. The
+// attributes of its HitRecord are computed once the final one is known, see
+// BoundingVolumeHierarchy::GetHitRecord.
+struct Hit {
+  float t;
+  // Same as HitRecord::primitive_id, -1 if nothing was hit.
+  int primitive_id;
+  // PrimitiveType of the primitive hit.
+  int type;
+  // Position of the primitive in the array of its PrimitiveType.
+  int index;
 };
 
 class BoundingBox {
@@ -26,47 +88,223 @@ class BoundingBox {
   BoundingBox(const parser::Vec3f& min_c, const parser::Vec3f& max_c)
       : min_corner(min_c), max_corner(max_c) {}
 
-  float DoesIntersect(const Ray& ray) const;
+  // Distance the ray enters the box at, clipped to [0, tmax], or kInf if it
+  // misses it within that interval.
+  float DoesIntersect(const Ray& ray, float tmax) const;
+  // Position of point along the Morton curve through the box, points outside
+  // of it are clamped to its faces.
+  unsigned GetMortonCode(const parser::Vec3f& point) const;
   void Expand(const BoundingBox& boudning_box);
+  void Expand(const parser::Vec3f& point);
   int GetMaxDimension() const;
   parser::Vec3f GetExtent() const;
   parser::Vec3f GetCenter() const;
+  float GetSurfaceArea() const;
+
+  // Bits of a Morton code per dimension, LBVH trees are at most
+  // 3 * kMortonBits + log2(#primitives) deep.
+  static constexpr const int kMortonBits = 10;
 
   parser::Vec3f min_corner;
   parser::Vec3f max_corner;
-  parser::Vec3f delta;
-  parser::Vec3f center;
 };
 
 class Object {
  public:
   virtual HitRecord GetIntersection(const Ray& ray) const = 0;
+  // Distance to the intersection along the ray or kInf if there is none,
+  // without computing any of the attributes of a HitRecord.
+  virtual float GetDistance(const Ray& ray) const = 0;
   virtual const BoundingBox GetBoundingBox() const = 0;
 };
 
-struct Node {
+struct BuildOptions {
+  enum SplitMethod {
+    MIDPOINT,
+    SAH,
+    // Orders primitives along a Morton curve, which builds much faster than
+    // SAH at the cost of a slower tree.
+    LBVH,
+    // SAH which may also split primitives by a plane, putting a reference to
+    // them in both children.
+    SBVH,
+  };
+
+  SplitMethod split_method = SAH;
+  // Number of buckets the centroids are binned into when evaluating SAH.
+  int bin_count = 16;
+  // Cost of visiting a node relative to a single primitive intersection.
+  float traversal_cost = .5;
+  // Most primitives a leaf may hold. SAH makes a leaf out of fewer only when
+  // that is cheaper than splitting them, 1 gives a leaf per primitive.
+  int max_leaf_size = 4;
+  // Children per node of the tree that is traversed, 2, 4 or 8. 0 picks the
+  // widest one the cpu has vector instructions for.
+  int node_width = 0;
+  // Whether the child boxes of 4 and 8 wide nodes are quantized to 8 bits,
+  // halving the memory of the tree at the cost of some extra box tests.
+  bool quantize_nodes = false;
+  // Triangles of a leaf tested at once with SIMD, 1, 4 or 8. 0 picks the
+  // widest one the cpu has vector instructions for, 1 tests them one by one.
+  int triangle_width = 1;
+  // Pool the tree is built on, nullptr builds it on the calling thread only.
+  ThreadPool* thread_pool = nullptr;
+  // Threads of thread_pool the tree is built with, 0 uses all of them.
+  int thread_count = 0;
+  // References SBVH may add per primitive by splitting it.
+  float spatial_split_budget = .5;
+
+  static SplitMethod ToSplitMethod(const std::string& str) {
+    if (str == "midpoint") return MIDPOINT;
+    if (str == "sbvh") return SBVH;
+    return str == "lbvh" ? LBVH : SAH;
+  }
+};
+
+enum PrimitiveType { TRIANGLE, SPHERE };
+
+namespace parser {
+struct Face;
+struct Sphere;
+}  // namespace parser
+
+// Triangles as structure of arrays holding what the intersection test needs,
+// faces[i] is the face the i-th one was made from and ids[i] its primitive id.
+// A face split by SBVH is in the array more than once. The arrays of floats
+// and ids are padded by AddPadding so that they can be loaded 8 at a time from
+// any triangle on. They are kept in an arena, Reserve makes room for all of
+// the triangles before they are added.
+struct TriangleArray {
+  explicit TriangleArray(Arena* arena);
+
+  ArenaVector<float> v0[3];
+  ArenaVector<float> edge1[3];
+  ArenaVector<float> edge2[3];
+  ArenaVector<const parser::Face*> faces;
+  ArenaVector<int> ids;
+
+  void Reserve(int count);
+  void Add(const parser::Face& face, int id);
+  void AddPadding();
+  // Same as parser::Face::GetIntersection(ray).t for the i-th triangle.
+  float GetDistance(int i, const Ray& ray) const;
+  // Computes GetDistance for the count triangles from first on at once, at
+  // most 4 or 8 of them. Returns the bit mask of those closest to the ray of
+  // the ones hit at a distance in (0, tmax] and not identified by hit_id,
+  // their distance is written to t.
+  int GetClosest4(int first, int count, const Ray& ray, int hit_id,
+                  float tmax, float* t) const;
+  __attribute__((target("avx2"))) int GetClosest8(int first, int count,
+                                                  const Ray& ray, int hit_id,
+                                                  float tmax, float* t) const;
+};
+
+struct SphereArray {
+  explicit SphereArray(Arena* arena);
+
+  ArenaVector<float> center[3];
+  ArenaVector<float> radius;
+  ArenaVector<const parser::Sphere*> spheres;
+  ArenaVector<int> ids;
+
+  void Reserve(int count);
+  void Add(const parser::Sphere& sphere, int id);
+  // Same as parser::Sphere::GetDistance(ray) for the i-th sphere.
+  float GetDistance(int i, const Ray& ray) const;
+};
+
+// Node of the flattened tree. Nodes are laid out in depth first order, so the
+// first child of an interior node is the node right after it and offset holds
+// the index of the second child. For leaves offset is the index of the first
+// primitive in the array of primitive_type.
+struct alignas(32) LinearNode {
   BoundingBox bounding_box;
-  Node* left;
-  Node* right;
-  int start;
-  int end;
+  int offset;
+  unsigned short primitive_count;
+  unsigned char axis;
+  unsigned char primitive_type;
 };
 
+struct BuildNode;
+template <int N>
+struct WideNode;
+template <int N>
+struct QuantizedWideNode;
+
 class BoundingVolumeHierarchy {
  public:
-  BoundingVolumeHierarchy(std::vector<Object*>* objects);
-  HitRecord GetIntersection(const Ray& ray, const Object* hit_obj) const;
-  bool GetIntersection(const Ray& ray, float tmax, const Object* hit_obj) const;
+  struct Stats {
+    int node_count;
+    int leaf_count;
+    int reference_count;
+    int max_depth;
+    float sah_cost;
+    double build_time_ms;
+    int node_width;
+    size_t node_bytes;
+  };
+
+  // Maximum depth of the tree, see kMaxSahDepth in bvh_builder.cpp.
+  static constexpr const int kMaxDepth = 128;
+  // 1 + 2 gamma(3), which bounds the rounding error of the slab test. The far
+  // distance of a box and tmax are scaled by it before the near distance is
+  // compared with them, so that a ray through an edge or a flat box still
+  // enters it, and a surface lying on the face of a box is not culled by a hit
+  // at the same distance before it.
+  static constexpr const float kRobustFactor =
+      1 + 3 * std::numeric_limits<float>::epsilon();
+
+  // The nodes and primitive arrays are allocated in arena, which the tree
+  // must not outlive.
+  BoundingVolumeHierarchy(const std::vector<const parser::Face*>& faces,
+                          const std::vector<const parser::Sphere*>& spheres,
+                          Arena* arena,
+                          const BuildOptions& options = BuildOptions());
+  BoundingVolumeHierarchy(const BoundingVolumeHierarchy&) = delete;
+  BoundingVolumeHierarchy& operator=(const BoundingVolumeHierarchy&) = delete;
+
+  // Primitives are identified by their position in faces, followed by the
+  // spheres. hit_id is the primitive_id of the surface the ray leaves, which
+  // it is not tested against, or -1.
+  HitRecord GetIntersection(const Ray& ray, int hit_id) const;
+  // Same as GetIntersection(rays[i], -1) for each of the count rays, at most
+  // kMaxPacketSize. Rays starting at the same point and going the same way
+  // along every axis, such as the primary rays of a block of pixels, are
+  // traced together as a packet.
+  void GetIntersections(const Ray* rays, int count,
+                        HitRecord* hit_records) const;
+  // Returns whether any primitive other than hit_id is hit before tmax,
+  // stopping at the first such hit rather than looking for the closest one.
+  bool Occluded(const Ray& ray, float tmax, int hit_id) const;
+  const Stats& GetStats() const { return stats_; }
 
  private:
-  void build(Node* cur, int left, int right);
-  void GetIntersection(const Ray& ray, Node* cur, HitRecord& hit_record,
-                       const Object* hit_obj) const;
-  void GetIntersection(const Ray& ray, Node* cur, float tmax, float& tmin,
-                       const Object* hit_obj) const;
-
-  std::vector<Object*>* objects_;
-  Node* tree_;
+  // Lowers hit to the closest hit on the count primitives of type from first
+  // on. Of hits at the same distance the one with the lowest id is kept, which
+  // does not depend on the order leaves are visited in.
+  void IntersectLeaf(int type, int first, int count, const Ray& ray,
+                     int hit_id, Hit& hit) const;
+  // Attributes of a hit on the primitives of the tree.
+  HitRecord GetHitRecord(const Ray& ray, const Hit& hit) const;
+  // GetClosest of the triangles of a leaf, triangle_width_ of them at a time.
+  int GetClosestTriangles(int first, int count, const Ray& ray, int hit_id,
+                          float tmax, float* t) const;
+  template <bool kAnyHit, typename LeafFunction>
+  void Traverse(const Ray& ray, const float& tmax,
+                LeafFunction intersect_leaf) const;
+  int Flatten(const std::vector<BuildNode>& build_nodes, int idx, int& offset);
+
+  TriangleArray triangles_;
+  SphereArray spheres_;
+  BuildOptions options_;
+  Stats stats_;
+  int node_width_;
+  int triangle_width_;
+  LinearNode* nodes_;
+  WideNode<4>* nodes4_;
+  WideNode<8>* nodes8_;
+  QuantizedWideNode<4>* quantized_nodes4_;
+  QuantizedWideNode<8>* quantized_nodes8_;
 };
 
 #endif
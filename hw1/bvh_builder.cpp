@@ -0,0 +1,627 @@
+#include "bvh_builder.h"
+#include <algorithm>
+#include "parser.h"
+#include "thread_pool.h"
+using parser::Face;
+using parser::Vec3f;
+
+namespace {
+
+// Past this depth only median splits are made, which bounds the depth of the
+// tree by kMaxSahDepth + log2(#primitives) for the traversal stacks.
+constexpr const int kMaxSahDepth = 64;
+// Smaller ranges are not worth handing to other threads.
+constexpr const int kMinParallelSize = 1 << 14;
+// Spatial splits are only tried where the children of the best object split
+// overlap by more than this fraction of the surface area of the root.
+constexpr const float kMinSpatialOverlap = 1e-5;
+
+struct Bin {
+  BoundingBox bounding_box;
+  int count = 0;
+};
+
+// Bin of a spatial split, counting the references that start and end in it.
+struct SpatialBin {
+  BoundingBox bounding_box;
+  int entries = 0;
+  int exits = 0;
+};
+
+int GetBinIndex(float center, float min_center, float scale, int bin_count) {
+  const int idx = (center - min_center) * scale;
+  return std::min(bin_count - 1, std::max(0, idx));
+}
+
+// Union of get_bounds(primitive) over the range. Boxes are merged exactly, so
+// the result does not depend on thread_count.
+template <typename GetBounds>
+BoundingBox GetRangeBounds(const std::vector<BuildPrimitive>& primitives,
+                           int left, int right, ThreadPool* thread_pool,
+                           int thread_count, GetBounds get_bounds) {
+  if (thread_count == 1) {
+    BoundingBox bounds;
+    for (int i = left; i < right; i++) bounds.Expand(get_bounds(primitives[i]));
+    return bounds;
+  }
+  std::vector<BoundingBox> chunk_bounds(thread_count);
+  ParallelFor(left, right, thread_pool, thread_count,
+              [&](int chunk, int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                  chunk_bounds[chunk].Expand(get_bounds(primitives[i]));
+                }
+              });
+  BoundingBox bounds;
+  for (const BoundingBox& chunk_bound : chunk_bounds) {
+    bounds.Expand(chunk_bound);
+  }
+  return bounds;
+}
+
+bool IsEmpty(const BoundingBox& bounding_box) {
+  const Vec3f extent = bounding_box.GetExtent();
+  return extent.x < 0 || extent.y < 0 || extent.z < 0;
+}
+
+BoundingBox Intersect(const BoundingBox& lhs, const BoundingBox& rhs) {
+  const Vec3f& lmin = lhs.min_corner;
+  const Vec3f& lmax = lhs.max_corner;
+  const Vec3f& rmin = rhs.min_corner;
+  const Vec3f& rmax = rhs.max_corner;
+  return BoundingBox(Vec3f(fmax(lmin.x, rmin.x), fmax(lmin.y, rmin.y),
+                           fmax(lmin.z, rmin.z)),
+                     Vec3f(fmin(lmax.x, rmax.x), fmin(lmax.y, rmax.y),
+                           fmin(lmax.z, rmax.z)));
+}
+
+// Bounds of the part of the reference between lo and hi along dimension.
+BoundingBox Clip(const BuildPrimitive& reference, int dimension, float lo,
+                 float hi) {
+  float min_corner[3] = {-kInf, -kInf, -kInf};
+  float max_corner[3] = {kInf, kInf, kInf};
+  min_corner[dimension] = lo;
+  max_corner[dimension] = hi;
+  const BoundingBox slab(Vec3f(min_corner[0], min_corner[1], min_corner[2]),
+                         Vec3f(max_corner[0], max_corner[1], max_corner[2]));
+  if (reference.face == nullptr) {
+    return Intersect(reference.bounding_box, slab);
+  }
+
+  // The part of a triangle in the slab is bounded by its vertices in it and
+  // the points its edges cross the planes of the slab at.
+  const Face& face = *reference.face;
+  const Vec3f vertices[3] = {face.v0, face.v1, face.v2};
+  BoundingBox bounds;
+  for (int i = 0; i < 3; i++) {
+    const Vec3f& a = vertices[i];
+    const Vec3f& b = vertices[(i + 1) % 3];
+    const float pa = a[dimension];
+    const float pb = b[dimension];
+    if (pa >= lo && pa <= hi) bounds.Expand(a);
+    for (const float plane : {lo, hi}) {
+      if ((pa < plane && plane < pb) || (pb < plane && plane < pa)) {
+        bounds.Expand(a + (b - a) * ((plane - pa) / (pb - pa)));
+      }
+    }
+  }
+  // Widened the same as the box of the face, see Face::kBoxMargin.
+  const BoundingBox box = face.GetBoundingBox();
+  const Vec3f margin = (box.max_corner - box.min_corner) * Face::kBoxMargin;
+  bounds = BoundingBox(bounds.min_corner - margin, bounds.max_corner + margin);
+  return Intersect(Intersect(bounds, slab), reference.bounding_box);
+}
+
+struct MortonKey {
+  unsigned code;
+  int index;
+};
+
+// Stable least significant digit radix sort of keys by code, a byte per pass.
+// Every pass counts the digits of thread_count chunks in parallel and then
+// scatters the chunks to where the counts of the ones before them end.
+void RadixSort(std::vector<MortonKey>& keys, ThreadPool* thread_pool,
+               int thread_count) {
+  constexpr const int kRadix = 256;
+  std::vector<MortonKey> sorted(keys.size());
+  std::vector<int> offsets(thread_count * kRadix);
+  for (int shift = 0; shift < 3 * BoundingBox::kMortonBits; shift += 8) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+    ParallelFor(0, keys.size(), thread_pool, thread_count,
+                [&](int chunk, int begin, int end) {
+                  int* count = &offsets[chunk * kRadix];
+                  for (int i = begin; i < end; i++) {
+                    count[keys[i].code >> shift & (kRadix - 1)]++;
+                  }
+                });
+    int sum = 0;
+    for (int digit = 0; digit < kRadix; digit++) {
+      for (int chunk = 0; chunk < thread_count; chunk++) {
+        int& offset = offsets[chunk * kRadix + digit];
+        const int count = offset;
+        offset = sum;
+        sum += count;
+      }
+    }
+    ParallelFor(0, keys.size(), thread_pool, thread_count,
+                [&](int chunk, int begin, int end) {
+                  int* offset = &offsets[chunk * kRadix];
+                  for (int i = begin; i < end; i++) {
+                    sorted[offset[keys[i].code >> shift & (kRadix - 1)]++] =
+                        keys[i];
+                  }
+                });
+    keys.swap(sorted);
+  }
+}
+
+}  // namespace
+
+int BvhBuilder::SplitMidpoint(BuildNode& cur, int left, int right) {
+  const int max_dimension = cur.bounding_box.GetMaxDimension();
+  const float mean = cur.bounding_box.GetCenter()[max_dimension];
+  cur.axis = max_dimension;
+
+  auto mid = std::partition(
+      primitives_->begin() + left, primitives_->begin() + right,
+      [max_dimension, mean](const BuildPrimitive& primitive) {
+        return primitive.center[max_dimension] < mean;
+      });
+  return mid - primitives_->begin();
+}
+
+int BvhBuilder::SplitSah(BuildNode& cur, int left, int right, float* cost) {
+  std::vector<BuildPrimitive>& primitives = *primitives_;
+  const int thread_count = GetThreadCount(left, right);
+  const BoundingBox center_bounds = GetRangeBounds(
+      primitives, left, right, options_.thread_pool, thread_count,
+      [](const BuildPrimitive& primitive) { return primitive.center; });
+
+  const int bin_count = options_.bin_count;
+  float scale[3];
+  for (int dimension = 0; dimension < 3; dimension++) {
+    const float extent = center_bounds.max_corner[dimension] -
+                         center_bounds.min_corner[dimension];
+    scale[dimension] = extent > 0 ? bin_count / extent : 0;
+  }
+  // Every chunk fills bins of its own for all three dimensions in one pass,
+  // they are merged into the ones of the first chunk afterwards. The bins are
+  // kept from node to node to save allocating them for each, the reference
+  // makes the chunks on other threads use the ones of this thread.
+  thread_local std::vector<Bin> bin_storage;
+  bin_storage.assign(thread_count * 3 * bin_count, Bin());
+  std::vector<Bin>& chunk_bins = bin_storage;
+  ParallelFor(left, right, options_.thread_pool, thread_count,
+              [&](int chunk, int begin, int end) {
+                Bin* bins = &chunk_bins[chunk * 3 * bin_count];
+                for (int i = begin; i < end; i++) {
+                  const BuildPrimitive& primitive = primitives[i];
+                  for (int dimension = 0; dimension < 3; dimension++) {
+                    Bin& bin =
+                        bins[dimension * bin_count +
+                             GetBinIndex(primitive.center[dimension],
+                                         center_bounds.min_corner[dimension],
+                                         scale[dimension], bin_count)];
+                    bin.bounding_box.Expand(primitive.bounding_box);
+                    bin.count++;
+                  }
+                }
+              });
+  for (int i = 3 * bin_count; i < thread_count * 3 * bin_count; i++) {
+    Bin& bin = chunk_bins[i % (3 * bin_count)];
+    bin.bounding_box.Expand(chunk_bins[i].bounding_box);
+    bin.count += chunk_bins[i].count;
+  }
+
+  const float area = cur.bounding_box.GetSurfaceArea();
+  thread_local std::vector<float> right_area;
+  right_area.resize(bin_count);
+  float best_cost = kInf;
+  int best_dimension = -1;
+  int best_bin = 0;
+  for (int dimension = 0; dimension < 3; dimension++) {
+    if (scale[dimension] == 0) continue;
+    const Bin* bins = &chunk_bins[dimension * bin_count];
+
+    // Sweep from the right to record the area of every right hand side, then
+    // from the left evaluating each of the bin_count - 1 candidate planes.
+    BoundingBox right_box;
+    for (int i = bin_count - 1; i > 0; i--) {
+      right_box.Expand(bins[i].bounding_box);
+      right_area[i] = right_box.GetSurfaceArea();
+    }
+    BoundingBox left_box;
+    int left_count = 0;
+    for (int i = 0; i < bin_count - 1; i++) {
+      left_box.Expand(bins[i].bounding_box);
+      left_count += bins[i].count;
+      const int right_count = right - left - left_count;
+      if (left_count == 0 || right_count == 0) continue;
+      const float cost =
+          options_.traversal_cost +
+          (left_box.GetSurfaceArea() * left_count +
+           right_area[i + 1] * right_count) /
+              area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_dimension = dimension;
+        best_bin = i;
+      }
+    }
+  }
+  if (cost != nullptr) *cost = best_cost;
+  if (best_dimension == -1) return left;
+  // Intersecting every primitive of a leaf costs one unit each.
+  if (best_cost >= right - left && FitsLeaf(left, right)) {
+    return -1;
+  }
+  cur.axis = best_dimension;
+
+  const float min_center = center_bounds.min_corner[best_dimension];
+  auto mid = std::partition(
+      primitives.begin() + left, primitives.begin() + right,
+      [&](const BuildPrimitive& primitive) {
+        return GetBinIndex(primitive.center[best_dimension], min_center,
+                           scale[best_dimension], bin_count) <= best_bin;
+      });
+  return mid - primitives.begin();
+}
+
+bool BvhBuilder::SplitSpatial(BuildNode& cur,
+                              std::vector<BuildPrimitive>& references,
+                              float cost, std::vector<BuildPrimitive>& left,
+                              std::vector<BuildPrimitive>& right) {
+  const int count = references.size();
+  const int bin_count = options_.bin_count;
+  const float area = cur.bounding_box.GetSurfaceArea();
+  thread_local std::vector<SpatialBin> bins;
+  thread_local std::vector<float> right_area;
+  thread_local std::vector<int> right_count;
+  bins.resize(bin_count);
+  right_area.resize(bin_count);
+  right_count.resize(bin_count);
+  float best_cost = cost;
+  int best_dimension = -1;
+  int best_bin = 0;
+  for (int dimension = 0; dimension < 3; dimension++) {
+    const float min = cur.bounding_box.min_corner[dimension];
+    const float extent = cur.bounding_box.max_corner[dimension] - min;
+    if (extent <= 0) continue;
+    const float scale = bin_count / extent;
+
+    // References are clipped to every bin they overlap.
+    for (SpatialBin& bin : bins) bin = SpatialBin();
+    for (const BuildPrimitive& reference : references) {
+      const int first = GetBinIndex(
+          reference.bounding_box.min_corner[dimension], min, scale, bin_count);
+      const int last = GetBinIndex(
+          reference.bounding_box.max_corner[dimension], min, scale, bin_count);
+      if (first == last) {
+        bins[first].bounding_box.Expand(reference.bounding_box);
+      }
+      for (int i = first; first != last && i <= last; i++) {
+        bins[i].bounding_box.Expand(Clip(reference, dimension,
+                                         min + i / scale,
+                                         min + (i + 1) / scale));
+      }
+      bins[first].entries++;
+      bins[last].exits++;
+    }
+
+    BoundingBox right_box;
+    int exits = 0;
+    for (int i = bin_count - 1; i > 0; i--) {
+      right_box.Expand(bins[i].bounding_box);
+      right_area[i] = right_box.GetSurfaceArea();
+      exits += bins[i].exits;
+      right_count[i] = exits;
+    }
+    BoundingBox left_box;
+    int left_count = 0;
+    for (int i = 0; i < bin_count - 1; i++) {
+      left_box.Expand(bins[i].bounding_box);
+      left_count += bins[i].entries;
+      const int duplicates = left_count + right_count[i + 1] - count;
+      if (left_count == 0 || right_count[i + 1] == 0 ||
+          duplicates > reference_budget_ || duplicates == count) {
+        continue;
+      }
+      const float split_cost =
+          options_.traversal_cost +
+          (left_box.GetSurfaceArea() * left_count +
+           right_area[i + 1] * right_count[i + 1]) /
+              area;
+      if (split_cost < best_cost) {
+        best_cost = split_cost;
+        best_dimension = dimension;
+        best_bin = i;
+      }
+    }
+  }
+  if (best_dimension == -1) return false;
+
+  const float min = cur.bounding_box.min_corner[best_dimension];
+  const float scale =
+      bin_count / (cur.bounding_box.max_corner[best_dimension] - min);
+  const float plane = min + (best_bin + 1) / scale;
+  for (const BuildPrimitive& reference : references) {
+    const int first =
+        GetBinIndex(reference.bounding_box.min_corner[best_dimension], min,
+                    scale, bin_count);
+    const int last =
+        GetBinIndex(reference.bounding_box.max_corner[best_dimension], min,
+                    scale, bin_count);
+    if (last <= best_bin) {
+      left.push_back(reference);
+    } else if (first > best_bin) {
+      right.push_back(reference);
+    } else {
+      BuildPrimitive part = reference;
+      part.bounding_box = Clip(reference, best_dimension, -kInf, plane);
+      part.center = part.bounding_box.GetCenter();
+      if (!IsEmpty(part.bounding_box)) left.push_back(part);
+      part.bounding_box = Clip(reference, best_dimension, plane, kInf);
+      part.center = part.bounding_box.GetCenter();
+      if (!IsEmpty(part.bounding_box)) right.push_back(part);
+    }
+  }
+  if (left.empty() || right.empty()) {
+    left.clear();
+    right.clear();
+    return false;
+  }
+  reference_budget_ -= left.size() + right.size() - count;
+  cur.axis = best_dimension;
+  return true;
+}
+
+int BvhBuilder::SplitMedian(BuildNode& cur, int left, int right) {
+  const int max_dimension = cur.bounding_box.GetMaxDimension();
+  const int mid_idx = (left + right) / 2;
+  cur.axis = max_dimension;
+  std::nth_element(primitives_->begin() + left, primitives_->begin() + mid_idx,
+                   primitives_->begin() + right,
+                   [max_dimension](const BuildPrimitive& lhs,
+                                   const BuildPrimitive& rhs) {
+                     return lhs.center[max_dimension] <
+                            rhs.center[max_dimension];
+                   });
+  return mid_idx;
+}
+
+BvhBuilder::BvhBuilder(const BuildOptions& options)
+    : options_(options), thread_count_(1) {
+  if (options.thread_pool != nullptr) {
+    thread_count_ = options.thread_pool->GetThreadCount();
+    if (options.thread_count > 0) {
+      thread_count_ = std::min(thread_count_, options.thread_count);
+    }
+  }
+}
+
+int BvhBuilder::GetThreadCount(int left, int right) const {
+  return right - left < kMinParallelSize ? 1 : thread_count_;
+}
+
+int BvhBuilder::SplitMorton(BuildNode& cur, int left, int right) {
+  const std::vector<BuildPrimitive>& primitives = *primitives_;
+  const unsigned first = primitives[left].morton_code;
+  const unsigned last = primitives[right - 1].morton_code;
+  if (first == last) return (left + right) / 2;
+
+  // The codes of the range agree above bit, so it is clear in a prefix of
+  // them and set in the rest. x, y and z take turns from the top bit down.
+  const int bit = 31 - __builtin_clz(first ^ last);
+  cur.axis = 2 - bit % 3;
+  auto mid = std::partition_point(
+      primitives.begin() + left, primitives.begin() + right,
+      [bit](const BuildPrimitive& primitive) {
+        return (primitive.morton_code >> bit & 1) == 0;
+      });
+  return mid - primitives.begin();
+}
+
+void BvhBuilder::SortByMortonCode() {
+  std::vector<BuildPrimitive>& primitives = *primitives_;
+  const int size = primitives.size();
+  const int thread_count = GetThreadCount(0, size);
+  const BoundingBox center_bounds = GetRangeBounds(
+      primitives, 0, size, options_.thread_pool, thread_count,
+      [](const BuildPrimitive& primitive) { return primitive.center; });
+  std::vector<MortonKey> keys(size);
+  ParallelFor(0, size, options_.thread_pool, thread_count,
+              [&](int, int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                  BuildPrimitive& primitive = primitives[i];
+                  primitive.morton_code =
+                      center_bounds.GetMortonCode(primitive.center);
+                  keys[i] = {primitive.morton_code, i};
+                }
+              });
+  RadixSort(keys, options_.thread_pool, thread_count);
+
+  std::vector<BuildPrimitive> sorted(size);
+  ParallelFor(0, size, options_.thread_pool, thread_count,
+              [&](int, int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                  sorted[i] = primitives[keys[i].index];
+                }
+              });
+  primitives.swap(sorted);
+}
+
+bool BvhBuilder::FitsLeaf(int left, int right) const {
+  if (right - left > options_.max_leaf_size) return false;
+  for (int i = left + 1; i < right; i++) {
+    if ((*primitives_)[i].type != (*primitives_)[left].type) return false;
+  }
+  return true;
+}
+
+int BvhBuilder::Build(int left, int right, int depth) {
+  const int idx = nodes_->size();
+  nodes_->emplace_back();
+  BuildNode cur;
+  cur.left = -1;
+  cur.right = -1;
+  cur.start = left;
+  cur.end = right;
+  cur.axis = 0;
+  cur.primitive_type = left < right ? (*primitives_)[left].type : TRIANGLE;
+  // Morton splits do not need the bounds, which are then cheaper to gather
+  // from the children.
+  const bool morton = options_.split_method == BuildOptions::LBVH;
+  if (!morton) {
+    cur.bounding_box = GetRangeBounds(
+        *primitives_, left, right, options_.thread_pool,
+        GetThreadCount(left, right),
+        [](const BuildPrimitive& primitive) { return primitive.bounding_box; });
+  }
+
+  const bool fits_leaf = FitsLeaf(left, right);
+  if (left + 1 < right) {
+    int mid_idx = left;
+    if (morton) {
+      mid_idx = fits_leaf ? -1 : SplitMorton(cur, left, right);
+    } else if (depth < kMaxSahDepth &&
+               options_.split_method == BuildOptions::SAH) {
+      mid_idx = SplitSah(cur, left, right);
+    } else if (fits_leaf) {
+      mid_idx = -1;
+    } else if (depth < kMaxSahDepth) {
+      mid_idx = SplitMidpoint(cur, left, right);
+    }
+    if (mid_idx != -1 && (mid_idx == left || mid_idx == right)) {
+      // Every center fell on the same side, make a leaf if the primitives fit
+      // in one and fall back to a median split otherwise.
+      mid_idx = fits_leaf ? -1 : SplitMedian(cur, left, right);
+    }
+    if (mid_idx != -1) BuildChildren(cur, left, mid_idx, right, depth);
+  }
+  if (morton && cur.left != -1) {
+    cur.bounding_box = (*nodes_)[cur.left].bounding_box;
+    cur.bounding_box.Expand((*nodes_)[cur.right].bounding_box);
+  } else if (morton) {
+    cur.bounding_box = GetRangeBounds(
+        *primitives_, left, right, nullptr, 1,
+        [](const BuildPrimitive& primitive) { return primitive.bounding_box; });
+  }
+  (*nodes_)[idx] = cur;
+  return idx;
+}
+
+int BvhBuilder::BuildSpatial(std::vector<BuildPrimitive>& references,
+                             int depth) {
+  const int idx = nodes_->size();
+  nodes_->emplace_back();
+  primitives_ = &references;
+  const int count = references.size();
+  BuildNode cur;
+  cur.left = -1;
+  cur.right = -1;
+  cur.axis = 0;
+  cur.primitive_type = count > 0 ? references[0].type : TRIANGLE;
+  const auto get_bounds = [](const BuildPrimitive& primitive) {
+    return primitive.bounding_box;
+  };
+  cur.bounding_box =
+      GetRangeBounds(references, 0, count, options_.thread_pool,
+                     GetThreadCount(0, count), get_bounds);
+  if (depth == 0) root_area_ = cur.bounding_box.GetSurfaceArea();
+
+  const bool fits_leaf = FitsLeaf(0, count);
+  int mid_idx = -1;
+  float cost = kInf;
+  if (count > 1) {
+    if (depth < kMaxSahDepth) {
+      mid_idx = SplitSah(cur, 0, count, &cost);
+    } else if (!fits_leaf) {
+      mid_idx = SplitMedian(cur, 0, count);
+    }
+    if (mid_idx == 0 || mid_idx == count) {
+      cost = kInf;
+      mid_idx = fits_leaf ? -1 : SplitMedian(cur, 0, count);
+    }
+  }
+
+  std::vector<BuildPrimitive> left;
+  std::vector<BuildPrimitive> right;
+  bool spatial = false;
+  if (mid_idx != -1 && depth < kMaxSahDepth && reference_budget_ > 0) {
+    const BoundingBox overlap = Intersect(
+        GetRangeBounds(references, 0, mid_idx, nullptr, 1, get_bounds),
+        GetRangeBounds(references, mid_idx, count, nullptr, 1, get_bounds));
+    if (cost == kInf ||
+        overlap.GetSurfaceArea() > kMinSpatialOverlap * root_area_) {
+      spatial = SplitSpatial(cur, references, cost, left, right);
+    }
+  }
+  if (mid_idx == -1) {
+    cur.start = output_->size();
+    output_->insert(output_->end(), references.begin(), references.end());
+    cur.end = output_->size();
+  } else {
+    if (!spatial) {
+      left.assign(references.begin(), references.begin() + mid_idx);
+      right.assign(references.begin() + mid_idx, references.end());
+    }
+    std::vector<BuildPrimitive>().swap(references);
+    cur.left = BuildSpatial(left, depth + 1);
+    cur.right = BuildSpatial(right, depth + 1);
+  }
+  (*nodes_)[idx] = cur;
+  return idx;
+}
+
+void BvhBuilder::BuildChildren(BuildNode& cur, int left, int mid, int right,
+                               int depth) {
+  if (GetThreadCount(left, right) == 1) {
+    cur.left = Build(left, mid, depth + 1);
+    cur.right = Build(mid, right, depth + 1);
+    return;
+  }
+
+  // The right subtree goes into nodes of its own with half of the threads,
+  // which are appended after the left one as the serial build would have.
+  BvhBuilder right_builder(*this);
+  std::vector<BuildNode> right_nodes;
+  right_builder.nodes_ = &right_nodes;
+  right_builder.thread_count_ = thread_count_ / 2;
+  thread_count_ -= right_builder.thread_count_;
+  options_.thread_pool->Run(2, [&](int child) {
+    if (child == 0) {
+      cur.left = Build(left, mid, depth + 1);
+    } else {
+      right_builder.Build(mid, right, depth + 1);
+    }
+  });
+  thread_count_ += right_builder.thread_count_;
+
+  cur.right = nodes_->size();
+  for (BuildNode node : right_nodes) {
+    if (node.left != -1) {
+      node.left += cur.right;
+      node.right += cur.right;
+    }
+    nodes_->push_back(node);
+  }
+}
+
+std::vector<BuildNode> BvhBuilder::Build(
+    std::vector<BuildPrimitive>& primitives) {
+  std::vector<BuildNode> nodes;
+  nodes.reserve(2 * primitives.size());
+  primitives_ = &primitives;
+  nodes_ = &nodes;
+  if (options_.split_method == BuildOptions::SBVH) {
+    std::vector<BuildPrimitive> output;
+    output.reserve(primitives.size());
+    output_ = &output;
+    reference_budget_ = primitives.size() * options_.spatial_split_budget;
+    BuildSpatial(primitives, 0);
+    primitives.swap(output);
+    return nodes;
+  }
+  if (options_.split_method == BuildOptions::LBVH) SortByMortonCode();
+  Build(0, primitives.size(), 0);
+  return nodes;
+}
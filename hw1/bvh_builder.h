@@ -0,0 +1,83 @@
+#ifndef _BVH_BUILDER_H_
+#define _BVH_BUILDER_H_
+
+#include <vector>
+#include "bounding_volume_hierarchy.h"
+
+// Primitive to build the tree over, index is its position in the list of
+// primitives of the same type. Spatial splits may leave several references to
+// a primitive, each with the part of its bounds on one side of the split.
+struct BuildPrimitive {
+  BoundingBox bounding_box;
+  parser::Vec3f center;
+  PrimitiveType type;
+  int index;
+  // Triangle to clip against split planes, nullptr for other types whose
+  // bounds are clipped instead.
+  const parser::Face* face;
+  // Position of center along the Morton curve, only set for LBVH.
+  unsigned morton_code;
+};
+
+// Node of the intermediate binary tree, children refer to indices in the node
+// vector returned by the builder and are -1 for leaves. The primitives of a
+// leaf all have the same type.
+struct BuildNode {
+  BoundingBox bounding_box;
+  int left;
+  int right;
+  int start;
+  int end;
+  int axis;
+  PrimitiveType primitive_type;
+};
+
+class BvhBuilder {
+ public:
+  explicit BvhBuilder(const BuildOptions& options);
+
+  // Builds a tree over primitives and reorders them so that every leaf covers
+  // a contiguous range. The root is the first node of the result.
+  std::vector<BuildNode> Build(std::vector<BuildPrimitive>& primitives);
+
+ private:
+  int Build(int left, int right, int depth);
+  // Builds the tree over references considering spatial splits too. Leaves
+  // are appended to output_ and references is released on the way.
+  int BuildSpatial(std::vector<BuildPrimitive>& references, int depth);
+  // Builds the children of cur, the right one on another thread when the
+  // range is large enough and this builder has threads to spare.
+  void BuildChildren(BuildNode& cur, int left, int mid, int right, int depth);
+  int SplitMidpoint(BuildNode& cur, int left, int right);
+  // Returns -1 when a leaf over the range is cheaper than any split, cost is
+  // set to the one of the split returned if it is not nullptr.
+  int SplitSah(BuildNode& cur, int left, int right, float* cost = nullptr);
+  // Distributes references to left and right by the cheapest spatial split,
+  // duplicating the ones straddling it. Returns false and leaves them as they
+  // are if there is none cheaper than cost within the reference budget.
+  bool SplitSpatial(BuildNode& cur, std::vector<BuildPrimitive>& references,
+                    float cost, std::vector<BuildPrimitive>& left,
+                    std::vector<BuildPrimitive>& right);
+  int SplitMedian(BuildNode& cur, int left, int right);
+  // Splits the range sorted by Morton code where its highest differing bit
+  // changes, or in the middle if all of the codes are the same.
+  int SplitMorton(BuildNode& cur, int left, int right);
+  // Sorts the primitives by the Morton code of their center.
+  void SortByMortonCode();
+  // Whether the range may be made a leaf.
+  bool FitsLeaf(int left, int right) const;
+  // Threads to share the work over the range with.
+  int GetThreadCount(int left, int right) const;
+
+  const BuildOptions options_;
+  std::vector<BuildPrimitive>* primitives_;
+  std::vector<BuildNode>* nodes_;
+  int thread_count_;
+  // Leaves of the spatial split build, the duplicates it may still make and
+  // the area of its root.
+  std::vector<BuildPrimitive>* output_;
+  int reference_budget_;
+  float root_area_;
+};
+
+#endif
@@ -1,52 +1,156 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
 #include "parser.h"
 #include "ppm.h"
 #include "scene_renderer.h"
 using namespace parser;
 
+namespace {
+
+struct Options {
+  BuildOptions bvh;
+  RenderOptions render;
+  std::vector<const char*> scene_paths;
+  // Threads of the pool the scenes are loaded, rendered and written on, 0 uses
+  // one per cpu.
+  int thread_count = 0;
+  bool pin_threads = false;
+  bool print_stats = false;
+};
+
+// Returns the value of a "--name=value" flag, or nullptr if arg is not name.
+const char* GetFlag(const char* arg, const char* name) {
+  const size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') return nullptr;
+  return arg + len + 1;
+}
+
+Options ParseOptions(int argc, char* argv[]) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const char* value;
+    if ((value = GetFlag(argv[i], "--bvh"))) {
+      options.bvh.split_method = BuildOptions::ToSplitMethod(value);
+    } else if ((value = GetFlag(argv[i], "--sah-bins"))) {
+      options.bvh.bin_count = std::max(2, atoi(value));
+    } else if ((value = GetFlag(argv[i], "--traversal-cost"))) {
+      options.bvh.traversal_cost = atof(value);
+    } else if ((value = GetFlag(argv[i], "--max-leaf-size"))) {
+      options.bvh.max_leaf_size = std::max(1, atoi(value));
+    } else if ((value = GetFlag(argv[i], "--sbvh-budget"))) {
+      options.bvh.spatial_split_budget = std::max(0., atof(value));
+    } else if ((value = GetFlag(argv[i], "--bvh-width"))) {
+      options.bvh.node_width = atoi(value);
+    } else if ((value = GetFlag(argv[i], "--triangle-width"))) {
+      options.bvh.triangle_width = atoi(value);
+    } else if (strcmp(argv[i], "--bvh-quantize") == 0) {
+      options.bvh.quantize_nodes = true;
+    } else if ((value = GetFlag(argv[i], "--secondary"))) {
+      options.render.secondary_rays = RenderOptions::ToSecondaryRays(value);
+    } else if ((value = GetFlag(argv[i], "--packet"))) {
+      options.render.packet_size = std::min(std::max(1, atoi(value)), 8);
+    } else if ((value = GetFlag(argv[i], "--tile"))) {
+      options.render.tile_size = std::max(1, atoi(value));
+    } else if ((value = GetFlag(argv[i], "--threads"))) {
+      options.thread_count = std::max(1, atoi(value));
+    } else if (strcmp(argv[i], "--pin") == 0) {
+      options.pin_threads = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      options.print_stats = true;
+    } else if (strncmp(argv[i], "--", 2) != 0) {
+      options.scene_paths.push_back(argv[i]);
+    } else {
+      std::cout << "ignoring unknown option " << argv[i] << std::endl;
+    }
+  }
+  return options;
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
+  const Options options = ParseOptions(argc, argv);
+  if (options.scene_paths.empty()) {
     std::cout << "please provide scene file" << std::endl;
     return 1;
   }
-  SceneRenderer scene_renderer(argv[1]);
-
-  for (const Camera& camera : scene_renderer.Cameras()) {
-    const int width = camera.image_width;
-    const int height = camera.image_height;
-    Vec3i* pixels = new Vec3i[width * height];
-    const int number_of_cores = std::thread::hardware_concurrency();
-    scene_renderer.SetUpScene(camera);
-    if (number_of_cores == 0 || height < number_of_cores) {
-      scene_renderer.RenderImage(camera, pixels, 0, height, width);
-    } else {
-      std::thread* threads = new std::thread[number_of_cores];
-      const int height_increase = height / number_of_cores;
-      for (int i = 0; i < number_of_cores; i++) {
-        const int min_height = i * height_increase;
-        const int max_height =
-            (i == number_of_cores - 1) ? height : (i + 1) * height_increase;
-        threads[i] = std::thread(&SceneRenderer::RenderImage, &scene_renderer,
-                                 camera, pixels, min_height, max_height, width);
-      }
-      for (int i = 0; i < number_of_cores; i++) threads[i].join();
-      delete[] threads;
+  ThreadPool thread_pool(options.thread_count, options.pin_threads);
+  // Every scene after the first is loaded while the one before it renders,
+  // and the images of a scene are written while the next one renders.
+  std::unique_ptr<SceneRenderer> next_scene(new SceneRenderer(
+      options.scene_paths[0], &thread_pool, options.bvh, options.render));
+  for (size_t s = 0; s < options.scene_paths.size(); s++) {
+    const std::unique_ptr<SceneRenderer> scene_renderer = std::move(next_scene);
+    if (s + 1 < options.scene_paths.size()) {
+      const char* scene_path = options.scene_paths[s + 1];
+      thread_pool.Submit([&next_scene, &thread_pool, &options, scene_path] {
+        next_scene.reset(new SceneRenderer(scene_path, &thread_pool,
+                                           options.bvh, options.render));
+      });
+    }
+    if (options.print_stats) {
+      const BoundingVolumeHierarchy::Stats& stats = scene_renderer->BvhStats();
+      std::cout << "bvh: " << stats.node_count << " nodes of width "
+                << stats.node_width << " ("
+                << stats.node_bytes / 1024 << "KiB), " << stats.leaf_count
+                << " leaves, " << stats.reference_count
+                << " references, depth "
+                << stats.max_depth << ", sah cost "
+                << stats.sah_cost << ", built in " << stats.build_time_ms
+                << "ms" << std::endl;
     }
-    unsigned char* image = new unsigned char[width * height * 3];
 
-    int idx = 0;
-    for (int i = 0; i < width; i++) {
-      for (int j = 0; j < height; j++) {
-        const Vec3i pixel = pixels[i * height + j];
-        image[idx++] = pixel.x;
-        image[idx++] = pixel.y;
-        image[idx++] = pixel.z;
+    // The images of all of the cameras are rendered at once, sharing the
+    // threads until the last of their tiles is done.
+    const std::vector<Camera>& cameras = scene_renderer->Cameras();
+    std::vector<CameraView> views;
+    std::vector<Vec3f*> results;
+    for (const Camera& camera : cameras) {
+      views.emplace_back(camera);
+      results.push_back(new Vec3f[camera.image_width * camera.image_height]);
+    }
+    std::vector<ThreadStats> thread_stats;
+    std::vector<BounceStats> bounce_stats;
+    scene_renderer->RenderImages(views, results, &thread_stats,
+                                 &bounce_stats);
+    if (options.print_stats) {
+      const char* scene_path = options.scene_paths[s];
+      for (size_t d = 0; d < bounce_stats.size(); d++) {
+        std::cout << scene_path << " bounce " << d << ": "
+                  << bounce_stats[d].rays << " rays, "
+                  << bounce_stats[d].shadow_rays << " shadow rays, sorted in "
+                  << bounce_stats[d].sort_ms << "ms, traced in "
+                  << bounce_stats[d].trace_ms << "ms" << std::endl;
+      }
+      double wall_ms = 0;
+      for (const ThreadStats& stats : thread_stats) {
+        wall_ms = std::max(wall_ms, stats.finish_ms);
       }
+      for (size_t t = 0; t < thread_stats.size(); t++) {
+        const ThreadStats& stats = thread_stats[t];
+        std::cout << scene_path << " thread " << t << ": " << stats.tiles
+                  << " tiles, " << stats.stolen_tiles << " stolen, busy "
+                  << stats.busy_ms << "ms of " << wall_ms << "ms ("
+                  << (wall_ms > 0 ? 100 * stats.busy_ms / wall_ms : 0)
+                  << "%), done at " << stats.finish_ms << "ms" << std::endl;
+      }
+    }
+    for (size_t c = 0; c < cameras.size(); c++) {
+      const int width = cameras[c].image_width;
+      const int height = cameras[c].image_height;
+      Vec3f* pixels = results[c];
+      const std::string image_name = cameras[c].image_name;
+      thread_pool.Submit([pixels, width, height, image_name] {
+        write_ppm(image_name.c_str(), pixels, width, height);
+        delete[] pixels;
+      });
     }
-    delete[] pixels;
-    write_ppm(camera.image_name.c_str(), image, width, height);
-    delete[] image;
+    thread_pool.Wait();
   }
   return 0;
 }
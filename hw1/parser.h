@@ -9,15 +9,6 @@
 #include "vector.h"
 
 namespace parser {
-namespace {
-
-float Determinant(Vec3f a, Vec3f b, Vec3f c) {
-  // vectors are columns
-  return a.x * (b.y * c.z - c.y * b.z) + a.y * (c.x * b.z - b.x * c.z) +
-         a.z * (b.x * c.y - c.x * b.y);
-}
-}  // namespace
-
 struct Camera {
   Vec3f position;
   Vec3f gaze;
@@ -41,7 +32,14 @@ struct Material {
   float phong_exponent;
 };
 
-struct Face : Object {
+struct Face final : Object {
+  // The box of a triangle is widened by this times its extent on each side.
+  // The triangle test accepts hits up to kBarycentricEpsilon outside of the
+  // triangle, which reach 3 times that past the box, and twice that covers
+  // the hits accepted by rounding. Otherwise such a hit would be culled or
+  // not depending on the boxes of the tree it lies in.
+  static constexpr const float kBoxMargin = 6 * kBarycentricEpsilon;
+
   Vec3f v0;
   Vec3f v1;
   Vec3f v2;
@@ -49,9 +47,9 @@ struct Face : Object {
   Vec3f normal;
 
   void CalculateNormal() {
-    ba = v0 - v1;
-    ca = v0 - v2;
-    normal = ba.CrossProduct(ca).Normalized();
+    edge1 = v1 - v0;
+    edge2 = v2 - v0;
+    normal = edge1.CrossProduct(edge2).Normalized();
 
     Vec3f min_c = v0;
     Vec3f max_c = v0;
@@ -71,45 +69,35 @@ struct Face : Object {
     max_c.x = fmax(max_c.x, v2.x);
     max_c.y = fmax(max_c.y, v2.y);
     max_c.z = fmax(max_c.z, v2.z);
-    bounding_box.min_corner = min_c;
-    bounding_box.max_corner = max_c;
+    const Vec3f margin = (max_c - min_c) * kBoxMargin;
+    bounding_box.min_corner = min_c - margin;
+    bounding_box.max_corner = max_c + margin;
   }
 
   HitRecord GetIntersection(const Ray& ray) const {
     HitRecord hit_record;
     hit_record.t = kInf;
     hit_record.material_id = -1;
-    if (!ray.is_shadow && ray.direction * normal > .0) {
-      return hit_record;
-    }
-    const Vec3f direction = ray.direction;
-    // a->v0 b->v1 c->v2
-    const float detA = Determinant(ba, ca, direction);
-    const Vec3f oa = (v0 - ray.origin) / detA;
-    const float beta = Determinant(oa, ca, direction);
-    if (beta < -kEpsilon) {
-      return hit_record;
-    }
-    const float gama = Determinant(ba, oa, direction);
-    if (gama < -kEpsilon || beta + gama > 1.0f + kEpsilon) {
-      return hit_record;
-    }
-    const float t = Determinant(ba, ca, oa);
-    if (t > -kEpsilon) {
+    const float t = GetDistance(ray);
+    if (t != kInf) {
       hit_record.t = t;
       hit_record.normal = normal;
       hit_record.material_id = material_id;
-      hit_record.obj = this;
     }
     return hit_record;
   }
 
+  float GetDistance(const Ray& ray) const {
+    float beta, gama;
+    return IntersectTriangle(v0, edge1, edge2, ray, beta, gama);
+  }
+
   const BoundingBox GetBoundingBox() const { return bounding_box; }
 
  private:
   BoundingBox bounding_box;
-  Vec3f ba;
-  Vec3f ca;
+  Vec3f edge1;
+  Vec3f edge2;
 };  // namespace parser
 
 struct Mesh {
@@ -122,7 +110,7 @@ struct Triangle {
   Face indices;
 };
 
-struct Sphere : Object {
+struct Sphere final : Object {
   int material_id;
   Vec3f center_of_sphere;
   float radius;
@@ -134,6 +122,16 @@ struct Sphere : Object {
   HitRecord GetIntersection(const Ray& ray) const {
     HitRecord hit_record;
     hit_record.material_id = -1;
+    hit_record.t = GetDistance(ray);
+    if (hit_record.t == kInf) {
+      return hit_record;
+    }
+    hit_record.material_id = material_id;
+    hit_record.normal = GetNormal(hit_record.t, ray);
+    return hit_record;
+  }
+
+  float GetDistance(const Ray& ray) const {
     const Vec3f sphere_to_camera = ray.origin - center_of_sphere;
     const float direction_times_sphere_to_camera =
         ray.direction * sphere_to_camera;
@@ -143,20 +141,14 @@ struct Sphere : Object {
     const float determinant =
         direction_times_sphere_to_camera * direction_times_sphere_to_camera -
         (norm_of_sphere_to_camera_squared - radius_squared);
-    hit_record.t = std::numeric_limits<float>::infinity();
     if (determinant < -kEpsilon) {
-      return hit_record;
+      return kInf;
     } else if (determinant < kEpsilon) {
-      hit_record.t = -direction_times_sphere_to_camera;
-    } else {
-      const float t1 = (-direction_times_sphere_to_camera + sqrt(determinant));
-      const float t2 = (-direction_times_sphere_to_camera - sqrt(determinant));
-      hit_record.t = fmin(t1, t2);
+      return -direction_times_sphere_to_camera;
     }
-    hit_record.material_id = material_id;
-    hit_record.normal = GetNormal(hit_record.t, ray);
-    hit_record.obj = this;
-    return hit_record;
+    const float t1 = (-direction_times_sphere_to_camera + sqrt(determinant));
+    const float t2 = (-direction_times_sphere_to_camera - sqrt(determinant));
+    return fmin(t1, t2);
   }
 
   void Initialize() {
@@ -1,7 +1,22 @@
 #include "ppm.h"
+#include <cstdio>
 #include <stdexcept>
+#include <vector>
 
-void write_ppm(const char* filename, unsigned char* data, int width,
+namespace {
+
+// Writes color, from 0 to 255, in decimal followed by a space.
+char* Append(int color, char* out) {
+  if (color >= 100) *out++ = '0' + color / 100;
+  if (color >= 10) *out++ = '0' + color / 10 % 10;
+  *out++ = '0' + color % 10;
+  *out++ = ' ';
+  return out;
+}
+
+}  // namespace
+
+void write_ppm(const char* filename, const parser::Vec3f* pixels, int width,
                int height) {
   FILE* outfile;
 
@@ -12,21 +27,21 @@ void write_ppm(const char* filename, unsigned char* data, int width,
 
   (void)fprintf(outfile, "P3\n%d %d\n255\n", width, height);
 
-  unsigned char color;
+  // Rows are quantized and formatted in a single pass into a buffer of "255 "
+  // per channel at most, and written at once.
+  std::vector<char> row(width * 12 + 1);
   for (size_t j = 0, idx = 0; j < height; ++j) {
-    for (size_t i = 0; i < width; ++i) {
-      for (size_t c = 0; c < 3; ++c, ++idx) {
-        color = data[idx];
-
-        if (i == width - 1 && c == 2) {
-          (void)fprintf(outfile, "%d", color);
-        } else {
-          (void)fprintf(outfile, "%d ", color);
-        }
-      }
+    char* out = row.data();
+    for (size_t i = 0; i < width; ++i, ++idx) {
+      const parser::Vec3i color = pixels[idx].ToVec3i();
+      out = Append(color.x, out);
+      out = Append(color.y, out);
+      out = Append(color.z, out);
     }
-
-    (void)fprintf(outfile, "\n");
+    // The last color of a row is not followed by a space.
+    if (width > 0) --out;
+    *out++ = '\n';
+    (void)fwrite(row.data(), 1, out - row.data(), outfile);
   }
 
   (void)fclose(outfile);
@@ -1,7 +1,11 @@
 #ifndef __ppm_h__
 #define __ppm_h__
 
-void write_ppm(const char* filename, unsigned char* data, int width,
+#include "vector.h"
+
+// Writes the colors of an image, width per row from the top, rounding and
+// clamping them to bytes on the way.
+void write_ppm(const char* filename, const parser::Vec3f* pixels, int width,
                int height);
 
 #endif  // __ppm_h__
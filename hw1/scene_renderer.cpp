@@ -1,110 +1,564 @@
 #include "scene_renderer.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <limits>
+#include <mutex>
+#include "ray_packet.h"
 using namespace parser;
 
 namespace {
 
 bool NotZero(const Vec3f vec) { return vec.x != 0 || vec.y != 0 || vec.z != 0; }
 
+// Pixels rendered together by RenderBatch, which keeps a ray and a color per
+// pixel and bounce. A wave is a batch over the whole image, rendered by all of
+// the threads.
+constexpr const int kBatchSize = 1 << 14;
+constexpr const int kWaveSize = 1 << 18;
+// Rays a thread takes at a time in the stages of a wave.
+constexpr const int kChunkSize = 1 << 10;
+
+double ElapsedMs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Calls function(begin, end) for chunks of about chunk_size out of [0, count),
+// on the threads of thread_pool or on this thread if it is nullptr.
+template <typename Function>
+void ForEachChunk(ThreadPool* thread_pool, int count, int chunk_size,
+                  Function function) {
+  ParallelFor(0, count, thread_pool, (count + chunk_size - 1) / chunk_size,
+              [&function](int, int begin, int end) { function(begin, end); });
+}
+
+// Returns the order to trace rays in, by the octant of their direction and
+// then along the Morton curve through the bounds of their origins, so that
+// consecutive rays go through the same nodes and primitives.
+std::vector<int> SortRays(const std::vector<Ray>& rays) {
+  BoundingBox bounds;
+  for (const Ray& ray : rays) bounds.Expand(ray.origin);
+  std::vector<std::pair<unsigned long long, int>> keys(rays.size());
+  for (size_t i = 0; i < rays.size(); i++) {
+    const Ray& ray = rays[i];
+    const unsigned octant = ray.sign[0] << 2 | ray.sign[1] << 1 | ray.sign[2];
+    keys[i] = {static_cast<unsigned long long>(octant)
+                       << 3 * BoundingBox::kMortonBits |
+                   bounds.GetMortonCode(ray.origin),
+               static_cast<int>(i)};
+  }
+  std::sort(keys.begin(), keys.end());
+  std::vector<int> order(rays.size());
+  for (size_t i = 0; i < rays.size(); i++) order[i] = keys[i].second;
+  return order;
+}
+
+// Tiles left to a thread, which it takes from the front while others that ran
+// out of their own steal from the back. Padded to a cache line so that the
+// threads do not contend over each other's ranges.
+struct alignas(64) TileRange {
+  std::mutex mutex;
+  int begin;
+  int end;
+
+  bool PopFront(int* tile) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (begin == end) return false;
+    *tile = begin++;
+    return true;
+  }
+
+  // Takes the back half of the tiles, rounded up, and returns their count.
+  int StealBack(int* first) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const int count = (end - begin + 1) / 2;
+    end -= count;
+    *first = end;
+    return count;
+  }
+};
+
+// Moves half of the tiles of the first thread after thread that has any over
+// to it and returns their count, 0 once there are none left to steal.
+int StealTiles(std::vector<TileRange>& ranges, int thread) {
+  const int thread_count = ranges.size();
+  for (int i = 1; i < thread_count; i++) {
+    int first;
+    const int count =
+        ranges[(thread + i) % thread_count].StealBack(&first);
+    if (count == 0) continue;
+    TileRange& range = ranges[thread];
+    std::lock_guard<std::mutex> lock(range.mutex);
+    range.begin = first;
+    range.end = first + count;
+    return count;
+  }
+  return 0;
+}
+
 }  // namespace
 
-const Vec3f SceneRenderer::CalculateS(int i, int j) const {
+const Vec3f CameraView::CalculateS(int i, int j) const {
   return q + usu * (i + .5) - vsv * (j + .5);
 }
 
 const Vec3f SceneRenderer::TraceRay(const Ray& ray, int depth,
-                                    const Object* hit_obj = nullptr) const {
-  Vec3f color = scene_.background_color;
-  const HitRecord hit_record =
-      bounding_volume_hierarchy->GetIntersection(ray, hit_obj);
-  const int material_id = hit_record.material_id;
-
-  if (material_id != -1) {
-    const Vec3f origin = ray.origin;
-    const Vec3f direction = ray.direction;
-    const Vec3f intersection_point = origin + direction * hit_record.t;
-    const Vec3f normal = hit_record.normal;
-    const Material material = scene_.materials[material_id];
-    color = scene_.ambient_light.PointWise(material.ambient);
-
-    for (const PointLight& light : scene_.point_lights) {
-      // Shadow check
-      const Vec3f wi = light.position - intersection_point;
-      const Vec3f wi_normal = wi.Normalized();
-      const Ray shadow_ray{
-          intersection_point + wi_normal * scene_.shadow_ray_epsilon, wi_normal,
-          true};
-      if (bounding_volume_hierarchy->GetIntersection(
-              shadow_ray, wi.Length() - scene_.shadow_ray_epsilon,
-              hit_record.obj)) {
-        continue;
-      }
-      const float r_square = wi * wi;
-      const Vec3f intensity = light.intensity / r_square;
-
-      // Diffuse light
-      const float cos_theta = wi_normal * normal;
-      const float cos_thetap = cos_theta > 0. ? cos_theta : 0.;
-      color += (material.diffuse * cos_thetap).PointWise(intensity);
-
-      // Specular light
-      const Vec3f h = (wi_normal - direction).Normalized();
-      const float cos_alpha = normal * h;
-      const float cos_alphap = cos_alpha > 0. ? cos_alpha : 0.;
-      color += (material.specular * pow(cos_alphap, material.phong_exponent))
-                   .PointWise(intensity);
-    }
-    // Specular reflection
-    if (depth > 0 && NotZero(material.mirror)) {
-      const Vec3f wi =
-          (direction + normal * -2 * (direction * normal)).Normalized();
-      const Ray reflection_ray{
-          intersection_point + wi * scene_.shadow_ray_epsilon, wi, false};
-      color += TraceRay(reflection_ray, depth - 1, hit_record.obj)
-                   .PointWise(material.mirror);
-    }
+                                    int hit_id = -1) const {
+  return Shade(ray, bounding_volume_hierarchy->GetIntersection(ray, hit_id),
+               depth);
+}
+
+const Ray SceneRenderer::ShadowRay(const Ray& ray, const HitRecord& hit_record,
+                                   const PointLight& light,
+                                   float* tmax) const {
+  const Vec3f intersection_point = ray.origin + ray.direction * hit_record.t;
+  const Vec3f wi = light.position - intersection_point;
+  const Vec3f wi_normal = wi.Normalized();
+  *tmax = wi.Length() - scene_.shadow_ray_epsilon;
+  return Ray{intersection_point + wi_normal * scene_.shadow_ray_epsilon,
+             wi_normal, true};
+}
+
+const Ray SceneRenderer::ReflectionRay(const Ray& ray,
+                                       const HitRecord& hit_record) const {
+  const Vec3f direction = ray.direction;
+  const Vec3f normal = hit_record.normal;
+  const Vec3f intersection_point = ray.origin + direction * hit_record.t;
+  const Vec3f wi =
+      (direction + normal * -2 * (direction * normal)).Normalized();
+  return Ray{intersection_point + wi * scene_.shadow_ray_epsilon, wi, false};
+}
+
+template <typename Visible>
+const Vec3f SceneRenderer::ShadeSurface(const Ray& ray,
+                                        const HitRecord& hit_record,
+                                        Visible visible) const {
+  const Vec3f origin = ray.origin;
+  const Vec3f direction = ray.direction;
+  const Vec3f intersection_point = origin + direction * hit_record.t;
+  const Vec3f normal = hit_record.normal;
+  const Material material = scene_.materials[hit_record.material_id];
+  Vec3f color = scene_.ambient_light.PointWise(material.ambient);
+
+  for (size_t i = 0; i < scene_.point_lights.size(); i++) {
+    const PointLight& light = scene_.point_lights[i];
+    if (!visible(i)) continue;
+    const Vec3f wi = light.position - intersection_point;
+    const Vec3f wi_normal = wi.Normalized();
+    const float r_square = wi * wi;
+    const Vec3f intensity = light.intensity / r_square;
+
+    // Diffuse light
+    const float cos_theta = wi_normal * normal;
+    const float cos_thetap = cos_theta > 0. ? cos_theta : 0.;
+    color += (material.diffuse * cos_thetap).PointWise(intensity);
+
+    // Specular light
+    const Vec3f h = (wi_normal - direction).Normalized();
+    const float cos_alpha = normal * h;
+    const float cos_alphap = cos_alpha > 0. ? cos_alpha : 0.;
+    color += (material.specular * pow(cos_alphap, material.phong_exponent))
+                 .PointWise(intensity);
   }
   return color;
 }
 
-const Vec3i SceneRenderer::RenderPixel(int i, int j,
-                                       const Camera& camera) const {
-  const Vec3f origin = camera.position;
-  const Vec3f direction = (CalculateS(i, j) - origin).Normalized();
+const Vec3f SceneRenderer::Shade(const Ray& ray, const HitRecord& hit_record,
+                                 int depth) const {
+  if (hit_record.material_id == -1) return scene_.background_color;
+  Vec3f color = ShadeSurface(ray, hit_record, [&](int i) {
+    float tmax;
+    const Ray shadow_ray =
+        ShadowRay(ray, hit_record, scene_.point_lights[i], &tmax);
+    return !bounding_volume_hierarchy->Occluded(shadow_ray, tmax,
+                                                hit_record.primitive_id);
+  });
+  // Specular reflection
+  const Vec3f mirror = scene_.materials[hit_record.material_id].mirror;
+  if (depth > 0 && NotZero(mirror)) {
+    color += TraceRay(ReflectionRay(ray, hit_record), depth - 1,
+                      hit_record.primitive_id)
+                 .PointWise(mirror);
+  }
+  return color;
+}
+
+const Vec3f SceneRenderer::RenderPixel(int i, int j,
+                                       const CameraView& view) const {
+  const Vec3f origin = view.camera->position;
+  const Vec3f direction = (view.CalculateS(i, j) - origin).Normalized();
   const Ray ray{origin, direction, false};
-  return SceneRenderer::TraceRay(ray, scene_.max_recursion_depth).ToVec3i();
+  return SceneRenderer::TraceRay(ray, scene_.max_recursion_depth);
+}
+
+void SceneRenderer::RenderBlock(const CameraView& view, Vec3f* result,
+                                int min_i, int min_j, int max_i, int max_j,
+                                int width) const {
+  const Vec3f origin = view.camera->position;
+  std::vector<Ray> rays;
+  rays.reserve(kMaxPacketSize);
+  for (int j = min_j; j < max_j; j++) {
+    for (int i = min_i; i < max_i; i++) {
+      const Vec3f direction = (view.CalculateS(i, j) - origin).Normalized();
+      rays.push_back(Ray{origin, direction, false});
+    }
+  }
+  HitRecord hit_records[kMaxPacketSize];
+  bounding_volume_hierarchy->GetIntersections(rays.data(), rays.size(),
+                                              hit_records);
+  int k = 0;
+  for (int j = min_j; j < max_j; j++) {
+    for (int i = min_i; i < max_i; i++, k++) {
+      result[j * width + i] =
+          Shade(rays[k], hit_records[k], scene_.max_recursion_depth);
+    }
+  }
+}
+
+void SceneRenderer::RenderBatch(const CameraView& view, Vec3f* result,
+                                int min_i, int min_j, int max_i, int max_j,
+                                int width, ThreadPool* thread_pool,
+                                std::vector<BounceStats>* stats) const {
+  const int max_depth = scene_.max_recursion_depth;
+  const bool sorted = options_.secondary_rays == RenderOptions::SORTED;
+  const int light_count = scene_.point_lights.size();
+  // rays[d][k] is the k-th ray of bounce d, which was reflected off the
+  // surface hit by ray parents[d][k] of bounce d - 1. For primary rays it is
+  // the index of their pixel in result. Every stage sizes the buffers it
+  // writes up front, with unset rays, so that their chunks can be written in
+  // parallel.
+  const Ray unset{Vec3f(), Vec3f(), false};
+  std::vector<std::vector<Ray>> rays(max_depth + 1);
+  std::vector<std::vector<int>> parents(max_depth + 1);
+  std::vector<std::vector<HitRecord>> hit_records(max_depth + 1);
+  std::vector<std::vector<Vec3f>> colors(max_depth + 1);
+  if (stats != nullptr && stats->size() < rays.size()) {
+    stats->resize(rays.size());
+  }
+
+  // Primary rays are traced in packets, which are coherent already. The
+  // blocks of a row of them are equally high, so the rays of a block follow
+  // the rows above it and the blocks before it in its row.
+  const auto primary_start = std::chrono::steady_clock::now();
+  const int size = std::max(1, options_.packet_size);
+  const int batch_width = max_i - min_i;
+  const int columns = (batch_width + size - 1) / size;
+  const int block_count = columns * ((max_j - min_j + size - 1) / size);
+  const int pixel_count = batch_width * (max_j - min_j);
+  rays[0].assign(pixel_count, unset);
+  parents[0].resize(pixel_count);
+  hit_records[0].resize(pixel_count);
+  ForEachChunk(
+      thread_pool, block_count, std::max(1, kChunkSize / (size * size)),
+      [&](int begin, int end) {
+        for (int block = begin; block < end; block++) {
+          const int i = min_i + block % columns * size;
+          const int j = min_j + block / columns * size;
+          const int block_max_i = std::min(i + size, max_i);
+          const int block_max_j = std::min(j + size, max_j);
+          const int first =
+              (j - min_j) * batch_width + (i - min_i) * (block_max_j - j);
+          const Vec3f origin = view.camera->position;
+          int k = first;
+          for (int y = j; y < block_max_j; y++) {
+            for (int x = i; x < block_max_i; x++, k++) {
+              const Vec3f direction =
+                  (view.CalculateS(x, y) - origin).Normalized();
+              rays[0][k] = Ray{origin, direction, false};
+              parents[0][k] = y * width + x;
+            }
+          }
+          bounding_volume_hierarchy->GetIntersections(
+              &rays[0][first], k - first, &hit_records[0][first]);
+        }
+      });
+  const double primary_ms = ElapsedMs(primary_start);
+
+  std::vector<Ray> shadow_rays;
+  std::vector<float> shadow_tmax;
+  std::vector<int> shadow_parents;
+  std::vector<char> visible;
+  for (int d = 0; d <= max_depth && !rays[d].empty(); d++) {
+    const std::vector<Ray>& bounce_rays = rays[d];
+    const std::vector<HitRecord>& bounce_hits = hit_records[d];
+    const int count = bounce_rays.size();
+    double sort_ms = 0;
+    hit_records[d].resize(count);
+    auto start = std::chrono::steady_clock::now();
+    if (d > 0) {
+      const std::vector<int> order =
+          sorted ? SortRays(bounce_rays) : std::vector<int>();
+      sort_ms += ElapsedMs(start);
+      ForEachChunk(thread_pool, count, kChunkSize, [&](int begin, int end) {
+        for (int k = begin; k < end; k++) {
+          const int i = sorted ? order[k] : k;
+          const int parent = parents[d][i];
+          hit_records[d][i] = bounding_volume_hierarchy->GetIntersection(
+              bounce_rays[i], hit_records[d - 1][parent].primitive_id);
+        }
+      });
+    }
+
+    // A shadow ray per light for every surface hit, in the order Shade
+    // traces them. Making them is not counted as tracing.
+    double trace_ms = ElapsedMs(start) - sort_ms;
+    std::vector<int> first_shadow_ray(count + 1);
+    for (int k = 0; k < count; k++) {
+      first_shadow_ray[k + 1] =
+          first_shadow_ray[k] +
+          (bounce_hits[k].material_id == -1 ? 0 : light_count);
+    }
+    const int shadow_count = first_shadow_ray[count];
+    shadow_rays.assign(shadow_count, unset);
+    shadow_tmax.resize(shadow_count);
+    shadow_parents.resize(shadow_count);
+    ForEachChunk(thread_pool, count, kChunkSize, [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        for (int i = first_shadow_ray[k]; i < first_shadow_ray[k + 1]; i++) {
+          const PointLight& light =
+              scene_.point_lights[i - first_shadow_ray[k]];
+          shadow_rays[i] = ShadowRay(bounce_rays[k], bounce_hits[k], light,
+                                     &shadow_tmax[i]);
+          shadow_parents[i] = k;
+        }
+      }
+    });
+    visible.resize(shadow_count);
+    start = std::chrono::steady_clock::now();
+    const std::vector<int> order =
+        sorted ? SortRays(shadow_rays) : std::vector<int>();
+    const double shadow_sort_ms = ElapsedMs(start);
+    sort_ms += shadow_sort_ms;
+    ForEachChunk(thread_pool, shadow_count, kChunkSize,
+                 [&](int begin, int end) {
+                   for (int k = begin; k < end; k++) {
+                     const int i = sorted ? order[k] : k;
+                     visible[i] = !bounding_volume_hierarchy->Occluded(
+                         shadow_rays[i], shadow_tmax[i],
+                         bounce_hits[shadow_parents[i]].primitive_id);
+                   }
+                 });
+    trace_ms += ElapsedMs(start) - shadow_sort_ms;
+    if (stats != nullptr) {
+      BounceStats& bounce_stats = (*stats)[d];
+      bounce_stats.rays += count;
+      bounce_stats.shadow_rays += shadow_count;
+      bounce_stats.sort_ms += sort_ms;
+      bounce_stats.trace_ms += trace_ms + (d == 0 ? primary_ms : 0);
+    }
+
+    // Surfaces with a mirror reflect a ray into the next bounce, after the
+    // ones of the surfaces before them.
+    std::vector<int> first_reflection(count + 1);
+    for (int k = 0; k < count; k++) {
+      const int material_id = bounce_hits[k].material_id;
+      first_reflection[k + 1] =
+          first_reflection[k] +
+          (d < max_depth && material_id != -1 &&
+           NotZero(scene_.materials[material_id].mirror));
+    }
+    if (first_reflection[count] > 0) {
+      rays[d + 1].assign(first_reflection[count], unset);
+      parents[d + 1].resize(first_reflection[count]);
+    }
+    colors[d].resize(count);
+    ForEachChunk(thread_pool, count, kChunkSize, [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        const HitRecord& hit_record = bounce_hits[k];
+        if (hit_record.material_id == -1) {
+          colors[d][k] = scene_.background_color;
+          continue;
+        }
+        colors[d][k] = ShadeSurface(
+            bounce_rays[k], hit_record,
+            [&](int i) { return visible[first_shadow_ray[k] + i] != 0; });
+        const int reflection = first_reflection[k];
+        if (reflection < first_reflection[k + 1]) {
+          rays[d + 1][reflection] = ReflectionRay(bounce_rays[k], hit_record);
+          parents[d + 1][reflection] = k;
+        }
+      }
+    });
+  }
+
+  // Add the reflections deepest first, as Shade does on its way back. Every
+  // surface reflects a single ray, so no two of them add to the same color.
+  for (int d = max_depth; d > 0; d--) {
+    const auto add_reflections = [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        const int parent = parents[d][k];
+        const Vec3f mirror =
+            scene_.materials[hit_records[d - 1][parent].material_id].mirror;
+        colors[d - 1][parent] += colors[d][k].PointWise(mirror);
+      }
+    };
+    ForEachChunk(thread_pool, rays[d].size(), kChunkSize, add_reflections);
+  }
+  ForEachChunk(thread_pool, pixel_count, kChunkSize, [&](int begin, int end) {
+    for (int k = begin; k < end; k++) {
+      result[parents[0][k]] = colors[0][k];
+    }
+  });
 }
 
-void SceneRenderer::RenderImage(const Camera& camera, Vec3i* result,
-                                const int min_height, const int max_height,
-                                const int width) const {
-  for (int j = min_height; j < max_height; j++) {
-    for (int i = 0; i < width; i++) {
-      result[j * width + i] = RenderPixel(i, j, camera);
+void SceneRenderer::RenderTile(const CameraView& view, Vec3f* result,
+                               int min_i, int min_j, int max_i, int max_j,
+                               int width,
+                               std::vector<BounceStats>* stats) const {
+  if (options_.secondary_rays != RenderOptions::RECURSIVE) {
+    // Whole blocks of packets at a time, with at least kBatchSize pixels.
+    const int size = std::max(1, options_.packet_size);
+    const int rows = (kBatchSize / (max_i - min_i) + size) / size * size;
+    for (int j = min_j; j < max_j; j += rows) {
+      RenderBatch(view, result, min_i, j, max_i, std::min(j + rows, max_j),
+                  width, nullptr, stats);
+    }
+    return;
+  }
+  const int size = options_.packet_size;
+  if (size <= 1) {
+    for (int j = min_j; j < max_j; j++) {
+      for (int i = min_i; i < max_i; i++) {
+        result[j * width + i] = RenderPixel(i, j, view);
+      }
+    }
+    return;
+  }
+  for (int j = min_j; j < max_j; j += size) {
+    for (int i = min_i; i < max_i; i += size) {
+      RenderBlock(view, result, i, j, std::min(i + size, max_i),
+                  std::min(j + size, max_j), width);
+    }
+  }
+}
+
+void SceneRenderer::RenderImages(const std::vector<CameraView>& views,
+                                 const std::vector<Vec3f*>& results,
+                                 std::vector<ThreadStats>* thread_stats,
+                                 std::vector<BounceStats>* stats) const {
+  const int size = std::max(1, options_.packet_size);
+  if (options_.secondary_rays == RenderOptions::WAVEFRONT) {
+    // Whole blocks of packets at a time, with at least kWaveSize pixels.
+    for (size_t v = 0; v < views.size(); v++) {
+      const int width = views[v].camera->image_width;
+      const int height = views[v].camera->image_height;
+      const int rows = (kWaveSize / width + size) / size * size;
+      for (int j = 0; j < height; j += rows) {
+        RenderBatch(views[v], results[v], 0, j, width,
+                    std::min(j + rows, height), width, thread_pool_, stats);
+      }
+    }
+    if (thread_stats != nullptr) thread_stats->clear();
+    return;
+  }
+  const int tile_size =
+      (std::max(1, options_.tile_size) + size - 1) / size * size;
+  // The tiles of the images follow each other, those of views[v] starting at
+  // first_tile[v], so that the threads go on with the next image rather than
+  // wait for the last tiles of one.
+  std::vector<int> first_tile(views.size() + 1);
+  std::vector<int> columns(views.size());
+  for (size_t v = 0; v < views.size(); v++) {
+    const Camera& camera = *views[v].camera;
+    columns[v] = (camera.image_width + tile_size - 1) / tile_size;
+    first_tile[v + 1] =
+        first_tile[v] +
+        columns[v] * ((camera.image_height + tile_size - 1) / tile_size);
+  }
+  const int tile_count = first_tile.back();
+  const int thread_count = std::max(
+      1, std::min(thread_pool_ != nullptr ? thread_pool_->GetThreadCount() : 1,
+                  tile_count));
+
+  // Every thread starts with an even share of the tiles in scanline order,
+  // which keeps the tiles a thread renders next to each other.
+  std::vector<TileRange> ranges(thread_count);
+  for (int t = 0; t < thread_count; t++) {
+    ranges[t].begin = static_cast<long long>(tile_count) * t / thread_count;
+    ranges[t].end =
+        static_cast<long long>(tile_count) * (t + 1) / thread_count;
+  }
+  std::vector<ThreadStats> local_thread_stats(thread_count);
+  std::vector<std::vector<BounceStats>> bounce_stats(thread_count);
+  const auto start = std::chrono::steady_clock::now();
+  auto render = [&](int t) {
+    ThreadStats& local_stats = local_thread_stats[t];
+    while (true) {
+      int tile;
+      if (!ranges[t].PopFront(&tile)) {
+        const int stolen = StealTiles(ranges, t);
+        if (stolen == 0) break;
+        local_stats.stolen_tiles += stolen;
+        continue;
+      }
+      const auto tile_start = std::chrono::steady_clock::now();
+      const int v = std::upper_bound(first_tile.begin(), first_tile.end(),
+                                     tile) -
+                    first_tile.begin() - 1;
+      const int width = views[v].camera->image_width;
+      const int height = views[v].camera->image_height;
+      const int min_i = (tile - first_tile[v]) % columns[v] * tile_size;
+      const int min_j = (tile - first_tile[v]) / columns[v] * tile_size;
+      RenderTile(views[v], results[v], min_i, min_j,
+                 std::min(min_i + tile_size, width),
+                 std::min(min_j + tile_size, height), width,
+                 stats != nullptr ? &bounce_stats[t] : nullptr);
+      local_stats.tiles++;
+      local_stats.busy_ms += ElapsedMs(tile_start);
+    }
+    local_stats.finish_ms = ElapsedMs(start);
+  };
+  if (thread_count == 1) {
+    render(0);
+  } else {
+    thread_pool_->Run(thread_count, render);
+  }
+
+  if (thread_stats != nullptr) *thread_stats = local_thread_stats;
+  if (stats == nullptr) return;
+  // Sum up the bounces over the threads, the time being cpu time.
+  for (const std::vector<BounceStats>& thread_bounces : bounce_stats) {
+    if (stats->size() < thread_bounces.size()) {
+      stats->resize(thread_bounces.size());
+    }
+    for (size_t d = 0; d < thread_bounces.size(); d++) {
+      (*stats)[d].rays += thread_bounces[d].rays;
+      (*stats)[d].shadow_rays += thread_bounces[d].shadow_rays;
+      (*stats)[d].sort_ms += thread_bounces[d].sort_ms;
+      (*stats)[d].trace_ms += thread_bounces[d].trace_ms;
     }
   }
 }
 
-SceneRenderer::SceneRenderer(const char* scene_path) {
+SceneRenderer::SceneRenderer(const char* scene_path, ThreadPool* thread_pool,
+                             const BuildOptions& bvh_options,
+                             const RenderOptions& options)
+    : options_(options), thread_pool_(thread_pool) {
   scene_.loadFromXml(scene_path);
-  for (Triangle& obj : scene_.triangles) {
-    objects_.push_back(&obj.indices);
+  std::vector<const Face*> faces;
+  std::vector<const Sphere*> spheres;
+  for (const Triangle& obj : scene_.triangles) {
+    faces.push_back(&obj.indices);
   }
-  for (Sphere& obj : scene_.spheres) {
-    objects_.push_back(&obj);
+  for (const Sphere& obj : scene_.spheres) {
+    spheres.push_back(&obj);
   }
-  for (Mesh& mesh : scene_.meshes) {
-    for (Face& obj : mesh.faces) {
-      objects_.push_back(&obj);
+  for (const Mesh& mesh : scene_.meshes) {
+    for (const Face& obj : mesh.faces) {
+      faces.push_back(&obj);
     }
   }
-  bounding_volume_hierarchy = new BoundingVolumeHierarchy(&objects_);
+  BuildOptions tree_options = bvh_options;
+  tree_options.thread_pool = thread_pool;
+  bounding_volume_hierarchy = scene_.arena.Create<BoundingVolumeHierarchy>(
+      faces, spheres, &scene_.arena, tree_options);
 }
 
-void SceneRenderer::SetUpScene(const Camera& camera) {
+CameraView::CameraView(const Camera& camera) : camera(&camera) {
   const Vec4f view_plane = camera.near_plane;
   const Vec3f gaze = camera.gaze.Normalized();
   const float dist = camera.near_distance;
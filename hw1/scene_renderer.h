@@ -1,31 +1,144 @@
 #ifndef _SCENE_RENDERER_H
 #define _SCENE_RENDERER_H
 
+#include <string>
+#include <vector>
 #include "bounding_volume_hierarchy.h"
 #include "parser.h"
 
+struct RenderOptions {
+  enum SecondaryRays {
+    // Reflections are traced depth first while shading.
+    RECURSIVE,
+    // Rows of pixels are rendered a bounce at a time, tracing the rays of a
+    // bounce one after another.
+    BATCHED,
+    // BATCHED with the rays of a bounce ordered by the octant of their
+    // direction and then along the Morton curve through their origins.
+    SORTED,
+    // The image is rendered in large batches whose stages, tracing the rays
+    // of a bounce, making and tracing their shadow rays and shading, are each
+    // spread over all of the threads rather than a batch per thread.
+    WAVEFRONT,
+  };
+
+  // Primary rays are traced in blocks of packet_size x packet_size pixels, at
+  // most 8. 1 traces them one at a time.
+  int packet_size = 4;
+  SecondaryRays secondary_rays = RECURSIVE;
+  // Side of the square tiles the image is split into, rounded up to a
+  // multiple of packet_size. Threads take tiles from their own share and
+  // steal from the others once they run out.
+  int tile_size = 32;
+
+  static SecondaryRays ToSecondaryRays(const std::string& str) {
+    if (str == "batched") return BATCHED;
+    if (str == "wavefront") return WAVEFRONT;
+    return str == "sorted" ? SORTED : RECURSIVE;
+  }
+};
+
+// Rays of a bounce, 0 being the primary ones, the time spent sorting them and
+// the time spent tracing them. Only batched rendering keeps track of them.
+struct BounceStats {
+  long rays = 0;
+  long shadow_rays = 0;
+  double sort_ms = 0;
+  double trace_ms = 0;
+};
+
+// Tiles a thread rendered, of which stolen_tiles were taken from others, the
+// time it spent rendering them and the time it ran out of tiles at, both from
+// the start of the image.
+struct ThreadStats {
+  int tiles = 0;
+  int stolen_tiles = 0;
+  double busy_ms = 0;
+  double finish_ms = 0;
+};
+
+// Where the rays of the image of a camera start and go through, set up once
+// and left as it is so that the images of several cameras can be rendered at
+// the same time.
+struct CameraView {
+  explicit CameraView(const parser::Camera& camera);
+
+  // Point at the center of pixel (i, j) on the image plane.
+  const parser::Vec3f CalculateS(int i, int j) const;
+
+  const parser::Camera* camera;
+  // Top left corner of the image plane and the steps from a pixel to the
+  // next one to its right and below it.
+  parser::Vec3f q, usu, vsv;
+};
+
 class SceneRenderer {
  private:
-  parser::Vec3f q, usu, vsv;
   parser::Scene scene_;
-  std::vector<Object*> objects_;
   BoundingVolumeHierarchy* bounding_volume_hierarchy;
+  RenderOptions options_;
+  ThreadPool* thread_pool_;
 
-  const parser::Vec3f TraceRay(const Ray& ray, int depth,
-                               const Object* hit_obj) const;
-  const parser::Vec3f CalculateS(int i, int j) const;
-  const parser::Vec3i RenderPixel(int i, int j,
-                                  const parser::Camera& camera) const;
+  const parser::Vec3f TraceRay(const Ray& ray, int depth, int hit_id) const;
+  // Color of the surface ray hit as described by hit_record.
+  const parser::Vec3f Shade(const Ray& ray, const HitRecord& hit_record,
+                            int depth) const;
+  // Color of the surface hit_record describes without its reflection, lit by
+  // the i-th light if visible(i) returns true.
+  template <typename Visible>
+  const parser::Vec3f ShadeSurface(const Ray& ray, const HitRecord& hit_record,
+                                   Visible visible) const;
+  // Ray from the surface hit_record describes towards light, which is in
+  // shadow if anything is hit before tmax.
+  const Ray ShadowRay(const Ray& ray, const HitRecord& hit_record,
+                      const parser::PointLight& light, float* tmax) const;
+  // Ray mirrored off the surface hit_record describes.
+  const Ray ReflectionRay(const Ray& ray, const HitRecord& hit_record) const;
+  const parser::Vec3f RenderPixel(int i, int j,
+                                  const CameraView& view) const;
+  // Renders the pixels from (min_i, min_j) up to (max_i, max_j) with their
+  // primary rays traced as one packet.
+  void RenderBlock(const CameraView& view, parser::Vec3f* result,
+                   int min_i, int min_j, int max_i, int max_j,
+                   int width) const;
+  // Renders the pixels from (min_i, min_j) up to (max_i, max_j) a bounce at a
+  // time, each stage on the threads of thread_pool or on this thread if it is
+  // nullptr. Stats of the bounces are added to stats if it is not nullptr.
+  void RenderBatch(const CameraView& view, parser::Vec3f* result,
+                   int min_i, int min_j, int max_i, int max_j, int width,
+                   ThreadPool* thread_pool,
+                   std::vector<BounceStats>* stats) const;
+  // Renders the pixels from (min_i, min_j) up to (max_i, max_j) the way the
+  // options say.
+  void RenderTile(const CameraView& view, parser::Vec3f* result,
+                  int min_i, int min_j, int max_i, int max_j, int width,
+                  std::vector<BounceStats>* stats) const;
 
  public:
-  SceneRenderer(const char* scene_path);
+  // The trees are built and the images rendered on the threads of
+  // thread_pool, or on the calling thread only if it is nullptr.
+  SceneRenderer(const char* scene_path, ThreadPool* thread_pool,
+                const BuildOptions& bvh_options = BuildOptions(),
+                const RenderOptions& options = RenderOptions());
+  SceneRenderer(const SceneRenderer&) = delete;
+  SceneRenderer& operator=(const SceneRenderer&) = delete;
 
-  void SetUpScene(const parser::Camera& camera);
   const std::vector<parser::Camera>& Cameras() const { return scene_.cameras; }
+  const BoundingVolumeHierarchy::Stats& BvhStats() const {
+    return bounding_volume_hierarchy->GetStats();
+  }
 
-  void RenderImage(const parser::Camera& camera, parser::Vec3i* result,
-                   const int min_height, const int max_height,
-                   const int width) const;
+  // Renders the image of every view into the result of the same index, a
+  // color per pixel in rows from the top, which are left unclamped for
+  // write_ppm to quantize. The tiles of all of them are shared by the threads
+  // of the pool, or with WAVEFRONT secondary rays the images are rendered one
+  // by one, wave by wave. The stats of every thread are written to
+  // thread_stats, which is left empty for waves, and the ones of the bounces
+  // of all threads added to stats, either may be nullptr.
+  void RenderImages(const std::vector<CameraView>& views,
+                    const std::vector<parser::Vec3f*>& results,
+                    std::vector<ThreadStats>* thread_stats = nullptr,
+                    std::vector<BounceStats>* stats = nullptr) const;
 };
 
 #endif
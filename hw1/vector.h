@@ -5,6 +5,7 @@
 #include <iostream>
 #include <limits>
 #include <vector>
+#include "arena.h"
 
 constexpr const float kInf = std::numeric_limits<float>::infinity();
 constexpr const float kEpsilon = 1e-6;
@@ -129,6 +130,10 @@ struct Triangle;
 struct Sphere;
 
 struct Scene {
+  // Holds what is made for the scene besides its vectors, such as the trees
+  // over it, and frees all of it along with the scene.
+  Arena arena;
+
   // Data
   Vec3i background_color;
   float shadow_ray_epsilon;
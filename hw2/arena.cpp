@@ -0,0 +1,45 @@
+#include "arena.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+namespace {
+
+// Alignment of every block, enough for the nodes of the wide trees.
+constexpr const size_t kBlockAlignment = 64;
+
+}  // namespace
+
+Arena::Arena(size_t block_size)
+    : block_size_(block_size), current_(nullptr), end_(nullptr), bytes_(0) {}
+
+Arena::~Arena() {
+  for (auto it = destructors_.rbegin(); it != destructors_.rend(); ++it) {
+    it->destroy(it->object);
+  }
+  for (void* block : blocks_) free(block);
+}
+
+void* Arena::Allocate(size_t bytes, size_t alignment) {
+  const size_t padding =
+      -reinterpret_cast<uintptr_t>(current_) & (alignment - 1);
+  if (current_ != nullptr && padding + bytes <= size_t(end_ - current_)) {
+    void* memory = current_ + padding;
+    current_ += padding + bytes;
+    return memory;
+  }
+  // Large allocations get a block of their own, leaving the rest of the
+  // current one to the small allocations that follow.
+  const bool own_block = bytes + alignment > block_size_;
+  const size_t size = own_block ? bytes : block_size_;
+  void* block = nullptr;
+  if (posix_memalign(&block, std::max(alignment, kBlockAlignment), size) != 0) {
+    throw std::bad_alloc();
+  }
+  blocks_.push_back(block);
+  bytes_ += size;
+  if (own_block) return block;
+  current_ = static_cast<char*>(block) + bytes;
+  end_ = static_cast<char*>(block) + size;
+  return block;
+}
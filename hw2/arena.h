@@ -0,0 +1,94 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Monotonic allocator for what is freed all at once, such as the textures of a
+// scene or a set of trees and their primitive arrays. Memory is handed out from
+// large blocks and only given back when the arena is destroyed, all at once.
+// Not safe to allocate from on several threads at the same time.
+class Arena {
+ public:
+  explicit Arena(size_t block_size = 1 << 20);
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // Uninitialized memory, alignment being a power of two.
+  void* Allocate(size_t bytes, size_t alignment);
+  // Array of count default initialized objects, which are never destroyed.
+  template <typename T>
+  T* AllocateArray(size_t count) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "array elements would not be destroyed");
+    T* array = static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+    for (size_t i = 0; i < count; i++) new (array + i) T;
+    return array;
+  }
+  // Object destroyed along with the arena, in the reverse order of creation.
+  template <typename T, typename... Args>
+  T* Create(Args&&... args) {
+    T* object = new (Allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value) {
+      destructors_.push_back(
+          {object, [](void* p) { static_cast<T*>(p)->~T(); }});
+    }
+    return object;
+  }
+  // Memory taken from the system so far.
+  size_t GetBytes() const { return bytes_; }
+
+ private:
+  struct Destructor {
+    void* object;
+    void (*destroy)(void*);
+  };
+
+  const size_t block_size_;
+  char* current_;
+  char* end_;
+  size_t bytes_;
+  std::vector<void*> blocks_;
+  std::vector<Destructor> destructors_;
+};
+
+// Allocator keeping a standard container in an arena. Memory it frees is not
+// reused, so containers should be reserved to their final size.
+template <typename T>
+struct ArenaAllocator {
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  explicit ArenaAllocator(Arena* arena) : arena(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+  T* allocate(size_t count) {
+    return static_cast<T*>(arena->Allocate(count * sizeof(T), alignof(T)));
+  }
+  void deallocate(T*, size_t) {}
+
+  Arena* arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena != b.arena;
+}
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+#endif
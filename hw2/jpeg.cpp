@@ -31,6 +31,8 @@ void read_jpeg_header(const char* filename, int& width, int& height) {
   jpeg_start_decompress(&cinfo);
   width = cinfo.output_width;
   height = cinfo.output_height;
+  fclose(infile);
+  jpeg_destroy_decompress(&cinfo);
 }
 
 void read_jpeg(const char* filename, unsigned char* image, size_t width,
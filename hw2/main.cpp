@@ -1,52 +1,287 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
 #include "parser.h"
 #include "ppm.h"
 #include "scene_renderer.h"
 using namespace parser;
 
+namespace {
+
+struct Options {
+  BuildOptions bvh;
+  RenderOptions render;
+  std::vector<const char*> scene_paths;
+  // Threads of the pool the scenes are loaded, rendered and written on, 0 uses
+  // one per cpu.
+  int thread_count = 0;
+  bool pin_threads = false;
+  bool print_stats = false;
+  // Frames rendered after the first with the objects moved and the trees
+  // refitted, each also rendered from trees built again if check_refit.
+  int frame_count = 0;
+  bool check_refit = false;
+};
+
+// Returns the value of a "--name=value" flag, or nullptr if arg is not name.
+const char* GetFlag(const char* arg, const char* name) {
+  const size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') return nullptr;
+  return arg + len + 1;
+}
+
+Options ParseOptions(int argc, char* argv[]) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const char* value;
+    if ((value = GetFlag(argv[i], "--bvh"))) {
+      options.bvh.split_method = BuildOptions::ToSplitMethod(value);
+    } else if ((value = GetFlag(argv[i], "--sah-bins"))) {
+      options.bvh.bin_count = std::max(2, atoi(value));
+    } else if ((value = GetFlag(argv[i], "--traversal-cost"))) {
+      options.bvh.traversal_cost = atof(value);
+    } else if ((value = GetFlag(argv[i], "--max-leaf-size"))) {
+      options.bvh.max_leaf_size = std::max(1, atoi(value));
+    } else if ((value = GetFlag(argv[i], "--sbvh-budget"))) {
+      options.bvh.spatial_split_budget = std::max(0., atof(value));
+    } else if ((value = GetFlag(argv[i], "--bvh-width"))) {
+      options.bvh.node_width = atoi(value);
+    } else if ((value = GetFlag(argv[i], "--triangle-width"))) {
+      options.bvh.triangle_width = atoi(value);
+    } else if (strcmp(argv[i], "--bvh-quantize") == 0) {
+      options.bvh.quantize_nodes = true;
+    } else if ((value = GetFlag(argv[i], "--secondary"))) {
+      options.render.secondary_rays = RenderOptions::ToSecondaryRays(value);
+    } else if ((value = GetFlag(argv[i], "--packet"))) {
+      options.render.packet_size = std::min(std::max(1, atoi(value)), 8);
+    } else if ((value = GetFlag(argv[i], "--tile"))) {
+      options.render.tile_size = std::max(1, atoi(value));
+    } else if ((value = GetFlag(argv[i], "--threads"))) {
+      options.thread_count = std::max(1, atoi(value));
+    } else if (strcmp(argv[i], "--pin") == 0) {
+      options.pin_threads = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      options.print_stats = true;
+    } else if ((value = GetFlag(argv[i], "--rebuild-threshold"))) {
+      options.bvh.rebuild_threshold = std::max(0., atof(value));
+    } else if ((value = GetFlag(argv[i], "--frames"))) {
+      options.frame_count = std::max(0, atoi(value));
+    } else if (strcmp(argv[i], "--check-refit") == 0) {
+      options.check_refit = true;
+    } else if (strncmp(argv[i], "--", 2) != 0) {
+      options.scene_paths.push_back(argv[i]);
+    } else {
+      std::cout << "ignoring unknown option " << argv[i] << std::endl;
+    }
+  }
+  return options;
+}
+
+double ElapsedMs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Moves the objects for frame of --frames: every rotation is turned 5 degrees
+// further and every translation taken 10% further from the origin per frame.
+void AnimateTransformations(int frame, std::vector<Translation>* translations,
+                            std::vector<Rotation>* rotations) {
+  const float factor = 1 + .1f * frame;
+  for (Translation& translation : *translations) {
+    translation.x *= factor;
+    translation.y *= factor;
+    translation.z *= factor;
+  }
+  for (Rotation& rotation : *rotations) rotation.angle += 5 * frame;
+}
+
+// image_name with "_<frame>" put before its extension, as it is for frame 0.
+std::string GetFrameImageName(const std::string& image_name, int frame) {
+  if (frame == 0) return image_name;
+  size_t dot = image_name.rfind('.');
+  const size_t slash = image_name.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = image_name.size();
+  }
+  return image_name.substr(0, dot) + "_" + std::to_string(frame) +
+         image_name.substr(dot);
+}
+
+// Renders the image of every view into a new framebuffer.
+std::vector<Vec3f*> RenderViews(const SceneRenderer& scene_renderer,
+                                const std::vector<CameraView>& views,
+                                std::vector<ThreadStats>* thread_stats,
+                                std::vector<BounceStats>* bounce_stats) {
+  std::vector<Vec3f*> results;
+  for (const CameraView& view : views) {
+    results.push_back(
+        new Vec3f[view.camera->image_width * view.camera->image_height]);
+  }
+  scene_renderer.RenderImages(views, results, thread_stats, bounce_stats);
+  return results;
+}
+
+// Writes the images of frame in the background and frees their framebuffers.
+void WriteImages(const std::vector<CameraView>& views,
+                 const std::vector<Vec3f*>& results, int frame,
+                 ThreadPool* thread_pool) {
+  for (size_t v = 0; v < views.size(); v++) {
+    const int width = views[v].camera->image_width;
+    const int height = views[v].camera->image_height;
+    Vec3f* pixels = results[v];
+    const std::string image_name =
+        GetFrameImageName(views[v].camera->image_name, frame);
+    thread_pool->Submit([pixels, width, height, image_name] {
+      write_ppm(image_name.c_str(), pixels, width, height);
+      delete[] pixels;
+    });
+  }
+}
+
+// Pixels of the images of views that differ between a and b.
+long long CountDifferentPixels(const std::vector<CameraView>& views,
+                               const std::vector<Vec3f*>& a,
+                               const std::vector<Vec3f*>& b) {
+  long long count = 0;
+  for (size_t v = 0; v < views.size(); v++) {
+    const int size = views[v].camera->image_width *
+                     views[v].camera->image_height;
+    for (int i = 0; i < size; i++) {
+      if (a[v][i].x != b[v][i].x || a[v][i].y != b[v][i].y ||
+          a[v][i].z != b[v][i].z) {
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
+  const Options options = ParseOptions(argc, argv);
+  if (options.scene_paths.empty()) {
     std::cout << "please provide scene file" << std::endl;
     return 1;
   }
-  SceneRenderer scene_renderer(argv[1]);
+  ThreadPool thread_pool(options.thread_count, options.pin_threads);
+  bool refit_failed = false;
+  // Every scene after the first is loaded while the one before it renders,
+  // and the images of a scene are written while the next one renders.
+  std::unique_ptr<SceneRenderer> next_scene(new SceneRenderer(
+      options.scene_paths[0], &thread_pool, options.bvh, options.render));
+  for (size_t s = 0; s < options.scene_paths.size(); s++) {
+    const std::unique_ptr<SceneRenderer> scene_renderer = std::move(next_scene);
+    if (s + 1 < options.scene_paths.size()) {
+      const char* scene_path = options.scene_paths[s + 1];
+      thread_pool.Submit([&next_scene, &thread_pool, &options, scene_path] {
+        next_scene.reset(new SceneRenderer(scene_path, &thread_pool,
+                                           options.bvh, options.render));
+      });
+    }
+    if (options.print_stats) {
+      const BoundingVolumeHierarchy::Stats& stats = scene_renderer->BvhStats();
+      std::cout << "bvh: " << stats.node_count << " nodes of width "
+                << stats.node_width << " ("
+                << stats.node_bytes / 1024 << "KiB), " << stats.leaf_count
+                << " leaves, " << stats.reference_count
+                << " references, depth "
+                << stats.max_depth << ", sah cost "
+                << stats.sah_cost << ", built in " << stats.build_time_ms
+                << "ms" << std::endl;
+    }
 
-  for (const Camera& camera : scene_renderer.Cameras()) {
-    const int width = camera.image_width;
-    const int height = camera.image_height;
-    Vec3i* pixels = new Vec3i[width * height];
-    const int number_of_cores = 128;
-    scene_renderer.SetUpScene(camera);
-    if (number_of_cores == 0 || height < number_of_cores) {
-      scene_renderer.RenderImage(camera, pixels, 0, height, width);
-    } else {
-      std::thread* threads = new std::thread[number_of_cores];
-      const int height_increase = height / number_of_cores;
-      for (int i = 0; i < number_of_cores; i++) {
-        const int min_height = i * height_increase;
-        const int max_height =
-            (i == number_of_cores - 1) ? height : (i + 1) * height_increase;
-        threads[i] = std::thread(&SceneRenderer::RenderImage, &scene_renderer,
-                                 camera, pixels, min_height, max_height, width);
+    // The images of all of the cameras are rendered at once, sharing the
+    // threads until the last of their tiles is done.
+    const char* scene_path = options.scene_paths[s];
+    std::vector<CameraView> views;
+    for (const Camera& camera : scene_renderer->Cameras()) {
+      views.emplace_back(camera);
+    }
+    std::vector<ThreadStats> thread_stats;
+    std::vector<BounceStats> bounce_stats;
+    WriteImages(views,
+                RenderViews(*scene_renderer, views, &thread_stats,
+                            &bounce_stats),
+                0, &thread_pool);
+    if (options.print_stats) {
+      for (size_t d = 0; d < bounce_stats.size(); d++) {
+        std::cout << scene_path << " bounce " << d << ": "
+                  << bounce_stats[d].rays << " rays, "
+                  << bounce_stats[d].shadow_rays << " shadow rays, sorted in "
+                  << bounce_stats[d].sort_ms << "ms, traced in "
+                  << bounce_stats[d].trace_ms << "ms" << std::endl;
+      }
+      double wall_ms = 0;
+      for (const ThreadStats& stats : thread_stats) {
+        wall_ms = std::max(wall_ms, stats.finish_ms);
+      }
+      for (size_t t = 0; t < thread_stats.size(); t++) {
+        const ThreadStats& stats = thread_stats[t];
+        std::cout << scene_path << " thread " << t << ": " << stats.tiles
+                  << " tiles, " << stats.stolen_tiles << " stolen, busy "
+                  << stats.busy_ms << "ms of " << wall_ms << "ms ("
+                  << (wall_ms > 0 ? 100 * stats.busy_ms / wall_ms : 0)
+                  << "%), done at " << stats.finish_ms << "ms" << std::endl;
+      }
+    }
+
+    // The frames after the first move the objects of the scene and refit the
+    // trees. --check-refit renders them again with trees built from scratch,
+    // which are to give the same pixels as hits do not depend on the tree. Its
+    // cameras are the same, so it renders the same views.
+    std::unique_ptr<SceneRenderer> rebuilt_scene;
+    if (options.frame_count > 0 && options.check_refit) {
+      BuildOptions bvh_options = options.bvh;
+      bvh_options.rebuild_threshold = 0;
+      rebuilt_scene.reset(new SceneRenderer(scene_path, &thread_pool,
+                                            bvh_options, options.render));
+    }
+    const std::vector<Scaling> scalings = scene_renderer->Scalings();
+    const std::vector<Translation> translations =
+        scene_renderer->Translations();
+    const std::vector<Rotation> rotations = scene_renderer->Rotations();
+    for (int frame = 1; frame <= options.frame_count; frame++) {
+      std::vector<Translation> frame_translations = translations;
+      std::vector<Rotation> frame_rotations = rotations;
+      AnimateTransformations(frame, &frame_translations, &frame_rotations);
+      auto start = std::chrono::steady_clock::now();
+      const bool refitted = scene_renderer->SetTransformations(
+          scalings, frame_translations, frame_rotations);
+      const double update_ms = ElapsedMs(start);
+      const std::vector<Vec3f*> results =
+          RenderViews(*scene_renderer, views, nullptr, nullptr);
+      if (options.print_stats) {
+        std::cout << scene_path << " frame " << frame << ": trees "
+                  << (refitted ? "refitted" : "built again") << " in "
+                  << update_ms << "ms" << std::endl;
       }
-      for (int i = 0; i < number_of_cores; i++) threads[i].join();
-      delete[] threads;
-    }
-    unsigned char* image = new unsigned char[width * height * 3];
-
-    int idx = 0;
-    for (int i = 0; i < width; i++) {
-      for (int j = 0; j < height; j++) {
-        const Vec3i pixel = pixels[i * height + j];
-        image[idx++] = pixel.x;
-        image[idx++] = pixel.y;
-        image[idx++] = pixel.z;
+      if (rebuilt_scene != nullptr) {
+        start = std::chrono::steady_clock::now();
+        rebuilt_scene->SetTransformations(scalings, frame_translations,
+                                          frame_rotations);
+        const double rebuild_ms = ElapsedMs(start);
+        const std::vector<Vec3f*> rebuilt_results =
+            RenderViews(*rebuilt_scene, views, nullptr, nullptr);
+        const long long different_pixels =
+            CountDifferentPixels(views, results, rebuilt_results);
+        std::cout << scene_path << " frame " << frame << ": "
+                  << different_pixels
+                  << " pixels differ from trees built again, updated in "
+                  << update_ms << "ms against " << rebuild_ms << "ms"
+                  << std::endl;
+        if (different_pixels > 0) refit_failed = true;
+        for (Vec3f* pixels : rebuilt_results) delete[] pixels;
       }
+      WriteImages(views, results, frame, &thread_pool);
     }
-    delete[] pixels;
-    write_ppm(camera.image_name.c_str(), image, width, height);
-    delete[] image;
+    thread_pool.Wait();
   }
-  return 0;
+  return refit_failed ? 1 : 0;
 }
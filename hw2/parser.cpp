@@ -3,6 +3,119 @@
 #include <stdexcept>
 #include "tinyxml2.h"
 
+namespace {
+
+using parser::Face;
+using parser::Matrix;
+using parser::Scene;
+using parser::Transformation;
+using parser::Vec3i;
+
+// Reads transformations listed as in "s1 t2 r1", which are applied in that
+// order. element is nullptr for an object without any.
+std::vector<Transformation> ReadTransformations(
+    const tinyxml2::XMLElement* element, std::stringstream& stream) {
+  std::vector<Transformation> transformations;
+  if (element == nullptr) return transformations;
+  char type;
+  int index;
+  stream.clear();
+  stream << element->GetText() << std::endl;
+  while (!(stream >> type).eof()) {
+    stream >> index;
+    Transformation transformation;
+    transformation.transformation_type = Transformation::GetType(type);
+    transformation.index = index - 1;
+    transformations.push_back(transformation);
+  }
+  stream.clear();
+  return transformations;
+}
+
+// Matrix taking an object with transformations into the scene.
+Matrix GetTransformation(const Scene& scene,
+                         const std::vector<Transformation>& transformations) {
+  Matrix transformation;
+  transformation.MakeIdentity();
+  for (const Transformation& t : transformations) {
+    switch (t.transformation_type) {
+      case Transformation::SCALING:
+        transformation = scene.scalings[t.index].ToMatrix() * transformation;
+        break;
+      case Transformation::TRANSLATION:
+        transformation =
+            scene.translations[t.index].ToMatrix() * transformation;
+        break;
+      case Transformation::ROTATION:
+        transformation = scene.rotations[t.index].ToMatrix() * transformation;
+        break;
+    }
+  }
+  return transformation;
+}
+
+Matrix GetInverseTransformation(
+    const Scene& scene, const std::vector<Transformation>& transformations) {
+  Matrix inverse_transformation;
+  inverse_transformation.MakeIdentity();
+  for (const Transformation& t : transformations) {
+    switch (t.transformation_type) {
+      case Transformation::SCALING:
+        inverse_transformation *= scene.scalings[t.index].InverseMatrix();
+        break;
+      case Transformation::TRANSLATION:
+        inverse_transformation *= scene.translations[t.index].InverseMatrix();
+        break;
+      case Transformation::ROTATION:
+        inverse_transformation *= scene.rotations[t.index].InverseMatrix();
+        break;
+    }
+  }
+  return inverse_transformation;
+}
+
+// Moves face onto the vertices at vertex_ids taken into the scene by
+// transformation.
+void PlaceFace(const Scene& scene, const Matrix& transformation,
+               const Vec3i& vertex_ids, Face& face) {
+  face.v0 = transformation * scene.vertex_data[vertex_ids.x];
+  face.v1 = transformation * scene.vertex_data[vertex_ids.y];
+  face.v2 = transformation * scene.vertex_data[vertex_ids.z];
+  face.CalculateNormal();
+}
+
+}  // namespace
+
+void parser::Scene::ApplyTransformations() {
+  for (Mesh& mesh : meshes) {
+    const Matrix transformation =
+        GetTransformation(*this, mesh.transformations);
+    for (size_t i = 0; i < mesh.faces.size(); i++) {
+      PlaceFace(*this, transformation, mesh.vertex_ids[i], mesh.faces[i]);
+    }
+  }
+  for (Triangle& triangle : triangles) {
+    PlaceFace(*this, GetTransformation(*this, triangle.transformations),
+              triangle.vertex_ids, triangle.indices);
+  }
+  for (Sphere& sphere : spheres) {
+    sphere.transformation = GetTransformation(*this, sphere.transformations);
+    sphere.inverse_transformation =
+        GetInverseTransformation(*this, sphere.transformations);
+    sphere.inverse_transformation_transpose =
+        sphere.inverse_transformation.Transpose();
+    sphere.Initialize();
+  }
+  for (MeshInstance& mesh_instance : mesh_instances) {
+    mesh_instance.transformation =
+        GetTransformation(*this, mesh_instance.transformations);
+    mesh_instance.inverse_transformation =
+        GetInverseTransformation(*this, mesh_instance.transformations);
+    mesh_instance.inverse_transformation_transpose =
+        mesh_instance.inverse_transformation.Transpose();
+  }
+}
+
 void parser::Scene::loadFromXml(const std::string& filepath) {
   tinyxml2::XMLDocument file;
   std::stringstream stream;
@@ -224,31 +337,7 @@ void parser::Scene::loadFromXml(const std::string& filepath) {
     }
 
     child = element->FirstChildElement("Transformations");
-    Matrix transformation;
-    transformation.MakeIdentity();
-    if (child != nullptr) {
-      char type;
-      int index;
-      stream.clear();
-      stream << child->GetText() << std::endl;
-      while (!(stream >> type).eof()) {
-        stream >> index;
-        index--;
-
-        switch (type) {
-          case 's':
-            transformation = scalings[index].ToMatrix() * transformation;
-            break;
-          case 't':
-            transformation = translations[index].ToMatrix() * transformation;
-            break;
-          case 'r':
-            transformation = rotations[index].ToMatrix() * transformation;
-            break;
-        }
-      }
-      stream.clear();
-    }
+    mesh.transformations = ReadTransformations(child, stream);
 
     child = element->FirstChildElement("Faces");
     stream << child->GetText() << std::endl;
@@ -256,9 +345,6 @@ void parser::Scene::loadFromXml(const std::string& filepath) {
     int v0_id, v1_id, v2_id;
     while (!(stream >> v0_id).eof()) {
       stream >> v1_id >> v2_id;
-      face.v0 = transformation * vertex_data[v0_id - 1];
-      face.v1 = transformation * vertex_data[v1_id - 1];
-      face.v2 = transformation * vertex_data[v2_id - 1];
       face.material_id = mesh.material_id;
       face.texture_id = mesh.texture_id;
       if (face.texture_id != -1) {
@@ -266,13 +352,14 @@ void parser::Scene::loadFromXml(const std::string& filepath) {
         face.ub = tex_coord_data[v1_id - 1];
         face.uc = tex_coord_data[v2_id - 1];
       }
-      face.CalculateNormal();
       mesh.faces.push_back(std::move(face));
+      mesh.vertex_ids.push_back({v0_id - 1, v1_id - 1, v2_id - 1});
     }
     stream.clear();
 
     meshes.push_back(std::move(mesh));
     mesh.faces.clear();
+    mesh.vertex_ids.clear();
     element = element->NextSiblingElement("Mesh");
   }
   stream.clear();
@@ -299,40 +386,7 @@ void parser::Scene::loadFromXml(const std::string& filepath) {
     }
 
     child = element->FirstChildElement("Transformations");
-    Matrix transformation;
-    transformation.MakeIdentity();
-    if (child != nullptr) {
-      char type;
-      int index;
-      stream.clear();
-      stream << child->GetText() << std::endl;
-      while (!(stream >> type).eof()) {
-        stream >> index;
-        index--;
-
-        switch (type) {
-          case 's':
-            transformation = scalings[index].ToMatrix() * transformation;
-            break;
-          case 't':
-            transformation = translations[index].ToMatrix() * transformation;
-            break;
-          case 'r':
-            transformation = rotations[index].ToMatrix() * transformation;
-            break;
-        }
-      }
-      stream.clear();
-    }
-    for (Face face : meshes[mesh_instance.base_mesh_id].faces) {
-      face.v0 = transformation * face.v0;
-      face.v1 = transformation * face.v1;
-      face.v2 = transformation * face.v2;
-      face.texture_id = mesh_instance.texture_id;
-      face.material_id = mesh_instance.material_id;
-      face.CalculateNormal();
-      mesh_instance.faces.push_back(face);
-    }
+    mesh_instance.transformations = ReadTransformations(child, stream);
 
     mesh_instances.push_back(std::move(mesh_instance));
     element = element->NextSiblingElement("MeshInstance");
@@ -358,40 +412,14 @@ void parser::Scene::loadFromXml(const std::string& filepath) {
     }
 
     child = element->FirstChildElement("Transformations");
-    Matrix transformation;
-    transformation.MakeIdentity();
-    if (child != nullptr) {
-      char type;
-      int index;
-      stream.clear();
-      stream << child->GetText() << std::endl;
-      while (!(stream >> type).eof()) {
-        stream >> index;
-        index--;
-
-        switch (type) {
-          case 's':
-            transformation = scalings[index].ToMatrix() * transformation;
-            break;
-          case 't':
-            transformation = translations[index].ToMatrix() * transformation;
-            break;
-          case 'r':
-            transformation = rotations[index].ToMatrix() * transformation;
-            break;
-        }
-      }
-      stream.clear();
-    }
+    triangle.transformations = ReadTransformations(child, stream);
 
     child = element->FirstChildElement("Indices");
     stream << child->GetText() << std::endl;
     int v0_id, v1_id, v2_id;
     stream >> v0_id >> v1_id >> v2_id;
 
-    triangle.indices.v0 = transformation * vertex_data[v0_id - 1];
-    triangle.indices.v1 = transformation * vertex_data[v1_id - 1];
-    triangle.indices.v2 = transformation * vertex_data[v2_id - 1];
+    triangle.vertex_ids = {v0_id - 1, v1_id - 1, v2_id - 1};
     triangle.indices.material_id = triangle.material_id;
     triangle.indices.texture_id = triangle.texture_id;
     if (triangle.texture_id != -1) {
@@ -399,7 +427,6 @@ void parser::Scene::loadFromXml(const std::string& filepath) {
       triangle.indices.ub = tex_coord_data[v1_id - 1];
       triangle.indices.uc = tex_coord_data[v2_id - 1];
     }
-    triangle.indices.CalculateNormal();
 
     triangles.push_back(std::move(triangle));
     element = element->NextSiblingElement("Triangle");
@@ -424,41 +451,7 @@ void parser::Scene::loadFromXml(const std::string& filepath) {
     }
 
     child = element->FirstChildElement("Transformations");
-    sphere.transformation.MakeIdentity();
-    sphere.inverse_transformation.MakeIdentity();
-    sphere.inverse_transformation_transpose.MakeIdentity();
-    if (child != nullptr) {
-      char type;
-      int index;
-      stream.clear();
-      stream << child->GetText() << std::endl;
-      while (!(stream >> type).eof()) {
-        stream >> index;
-        index--;
-
-        switch (type) {
-          case 's':
-            sphere.transformation =
-                scalings[index].ToMatrix() * sphere.transformation;
-            sphere.inverse_transformation *= scalings[index].InverseMatrix();
-            break;
-          case 't':
-            sphere.transformation =
-                translations[index].ToMatrix() * sphere.transformation;
-            sphere.inverse_transformation *=
-                translations[index].InverseMatrix();
-            break;
-          case 'r':
-            sphere.transformation =
-                rotations[index].ToMatrix() * sphere.transformation;
-            sphere.inverse_transformation *= rotations[index].InverseMatrix();
-            break;
-        }
-      }
-      stream.clear();
-      sphere.inverse_transformation_transpose =
-          sphere.inverse_transformation.Transpose();
-    }
+    sphere.transformations = ReadTransformations(child, stream);
 
     child = element->FirstChildElement("Center");
     stream << child->GetText() << std::endl;
@@ -469,18 +462,18 @@ void parser::Scene::loadFromXml(const std::string& filepath) {
     child = element->FirstChildElement("Radius");
     stream << child->GetText() << std::endl;
     stream >> sphere.radius;
-    sphere.Initialize();
 
     spheres.push_back(std::move(sphere));
     element = element->NextSiblingElement("Sphere");
   }
+  ApplyTransformations();
 
   // Get Textures
   element = root->FirstChildElement("Textures");
   if (element) {
     element = element->FirstChildElement("Texture");
     while (element) {
-      Texture* texture = new Texture;
+      Texture* texture = arena.Create<Texture>();
       child = element->FirstChildElement("ImageName");
       texture->image_name = child->GetText();
       child = element->FirstChildElement("Interpolation");
@@ -490,7 +483,7 @@ void parser::Scene::loadFromXml(const std::string& filepath) {
       texture->decal_mode = Texture::ToDecalMode(child->GetText());
       child = element->FirstChildElement("Appearance");
       texture->appearance = Texture::ToApperance(child->GetText());
-      texture->LoadImage();
+      texture->LoadImage(&arena);
 
       textures.push_back(texture);
       element = element->NextSiblingElement("Texture");
@@ -1,6 +1,7 @@
 #ifndef __HW1__PARSER__
 #define __HW1__PARSER__
 
+#include <algorithm>
 #include <cmath>
 #include <limits>
 #include <memory>
@@ -11,15 +12,6 @@
 #include "vector.h"
 
 namespace parser {
-namespace {
-
-float Determinant(Vec3f a, Vec3f b, Vec3f c) {
-  // vectors are columns
-  return a.x * (b.y * c.z - c.y * b.z) + a.y * (c.x * b.z - b.x * c.z) +
-         a.z * (b.x * c.y - c.x * b.y);
-}
-}  // namespace
-
 struct Transformation {
   enum TransformationType {
     SCALING,
@@ -27,6 +19,7 @@ struct Transformation {
     ROTATION,
   };
   TransformationType transformation_type;
+  // Position in the scalings, translations or rotations of the scene.
   int index;
 
   static TransformationType GetType(char c) {
@@ -38,7 +31,7 @@ struct Transformation {
 struct Scaling : Transformation {
   float x, y, z;
 
-  Matrix ToMatrix() {
+  Matrix ToMatrix() const {
     Matrix mat;
     mat[0][0] = x;
     mat[1][1] = y;
@@ -48,7 +41,7 @@ struct Scaling : Transformation {
     return mat;
   }
 
-  Matrix InverseMatrix() {
+  Matrix InverseMatrix() const {
     Matrix mat;
     mat[0][0] = 1 / x;
     mat[1][1] = 1 / y;
@@ -62,7 +55,7 @@ struct Scaling : Transformation {
 struct Translation : Transformation {
   float x, y, z;
 
-  Matrix ToMatrix() {
+  Matrix ToMatrix() const {
     Matrix mat;
     mat.MakeIdentity();
     mat[0][3] = x;
@@ -72,7 +65,7 @@ struct Translation : Transformation {
     return mat;
   }
 
-  Matrix InverseMatrix() {
+  Matrix InverseMatrix() const {
     Matrix mat;
     mat.MakeIdentity();
     mat[0][3] = -x;
@@ -87,7 +80,7 @@ struct Translation : Transformation {
 struct Rotation : Transformation {
   float angle, x, y, z;
 
-  Matrix ToMatrix() {
+  Matrix ToMatrix() const {
     const Vec3f u = Vec3f(x, y, z).Normalized();
     const Vec3f v = ((x != 0 || y != 0) ? Vec3f(-u.y, u.x, .0) : Vec3f(0, 1, 0))
                         .Normalized();
@@ -116,7 +109,7 @@ struct Rotation : Transformation {
     return M.Transpose() * (rot * M);
   }
 
-  Matrix InverseMatrix() {
+  Matrix InverseMatrix() const {
     const Vec3f u = Vec3f(x, y, z).Normalized();
     const Vec3f v = ((x != 0 || y != 0) ? Vec3f(-u.y, u.x, .0) : Vec3f(0, 1, 0))
                         .Normalized();
@@ -183,15 +176,13 @@ struct Texture {
   int height;
   unsigned char* image_data;
 
-  void LoadImage() {
+  void LoadImage(Arena* arena) {
     read_jpeg_header(image_name.c_str(), width, height);
 
-    image_data = new unsigned char[width * height * 3];
+    image_data = arena->AllocateArray<unsigned char>(width * height * 3);
     read_jpeg(image_name.c_str(), image_data, width, height);
   }
 
-  //~Texture() { delete image_data; }
-
   Vec3f Get(float u, float v) const {
     if (appearance == CLAMP) {
       u = fmax(0., fmin(1., u));
@@ -215,21 +206,35 @@ struct Texture {
       const unsigned int q = v;
       const float dx = u - p;
       const float dy = v - q;
+      // Past the last column or row, repeated textures wrap around and clamped
+      // ones keep the edge.
+      unsigned int next_p = p + 1;
+      unsigned int next_q = q + 1;
+      if (appearance == CLAMP) {
+        next_p = std::min<unsigned int>(next_p, width - 1);
+        next_q = std::min<unsigned int>(next_q, height - 1);
+      } else {
+        next_p %= width;
+        next_q %= height;
+      }
       const unsigned int pos = q * width * 3 + p * 3;
+      const unsigned int right = q * width * 3 + next_p * 3;
+      const unsigned int below = next_q * width * 3 + p * 3;
+      const unsigned int diagonal = next_q * width * 3 + next_p * 3;
       color.x = image_data[pos] * (1 - dx) * (1 - dy);
-      color.x += image_data[pos + 3] * (dx) * (1 - dy);
-      color.x += image_data[pos + 3 + width * 3] * (dx) * (dy);
-      color.x += image_data[pos + width * 3] * (1 - dx) * (dy);
+      color.x += image_data[right] * (dx) * (1 - dy);
+      color.x += image_data[diagonal] * (dx) * (dy);
+      color.x += image_data[below] * (1 - dx) * (dy);
 
       color.y = image_data[pos + 1] * (1 - dx) * (1 - dy);
-      color.y += image_data[pos + 3 + 1] * (dx) * (1 - dy);
-      color.y += image_data[pos + 3 + width * 3 + 1] * (dx) * (dy);
-      color.y += image_data[pos + width * 3 + 1] * (1 - dx) * (dy);
+      color.y += image_data[right + 1] * (dx) * (1 - dy);
+      color.y += image_data[diagonal + 1] * (dx) * (dy);
+      color.y += image_data[below + 1] * (1 - dx) * (dy);
 
       color.z = image_data[pos + 2] * (1 - dx) * (1 - dy);
-      color.z += image_data[pos + 3 + 2] * (dx) * (1 - dy);
-      color.z += image_data[pos + 3 + width * 3 + 2] * (dx) * (dy);
-      color.z += image_data[pos + width * 3 + 2] * (1 - dx) * (dy);
+      color.z += image_data[right + 2] * (dx) * (1 - dy);
+      color.z += image_data[diagonal + 2] * (dx) * (dy);
+      color.z += image_data[below + 2] * (1 - dx) * (dy);
     }
 
     if (decal_mode == BLEND_KD || decal_mode == REPLACE_KD) {
@@ -262,7 +267,14 @@ struct Material {
   float phong_exponent;
 };
 
-struct Face : Object {
+struct Face final : Object {
+  // The box of a triangle is widened by this times its extent on each side.
+  // The triangle test accepts hits up to kBarycentricEpsilon outside of the
+  // triangle, which reach 3 times that past the box, and twice that covers
+  // the hits accepted by rounding. Otherwise such a hit would be culled or
+  // not depending on the boxes of the tree it lies in.
+  static constexpr const float kBoxMargin = 6 * kBarycentricEpsilon;
+
   Vec3f v0;
   Vec3f ua;
   Vec3f v1;
@@ -274,9 +286,9 @@ struct Face : Object {
   Vec3f normal;
 
   void CalculateNormal() {
-    ba = v0 - v1;
-    ca = v0 - v2;
-    normal = ba.CrossProduct(ca).Normalized();
+    edge1 = v1 - v0;
+    edge2 = v2 - v0;
+    normal = edge1.CrossProduct(edge2).Normalized();
 
     Vec3f min_c = v0;
     Vec3f max_c = v0;
@@ -296,36 +308,22 @@ struct Face : Object {
     max_c.x = fmax(max_c.x, v2.x);
     max_c.y = fmax(max_c.y, v2.y);
     max_c.z = fmax(max_c.z, v2.z);
-    bounding_box.min_corner = min_c;
-    bounding_box.max_corner = max_c;
+    const Vec3f margin = (max_c - min_c) * kBoxMargin;
+    bounding_box.min_corner = min_c - margin;
+    bounding_box.max_corner = max_c + margin;
   }
 
   HitRecord GetIntersection(const Ray& ray) const {
     HitRecord hit_record;
     hit_record.t = kInf;
     hit_record.material_id = -1;
-    if (!ray.is_shadow && ray.direction * normal > .0) {
-      return hit_record;
-    }
-    const Vec3f direction = ray.direction;
-    // a->v0 b->v1 c->v2
-    const float detA = Determinant(ba, ca, direction);
-    const Vec3f oa = (v0 - ray.origin) / detA;
-    const float beta = Determinant(oa, ca, direction);
-    if (beta < -kEpsilon) {
-      return hit_record;
-    }
-    const float gama = Determinant(ba, oa, direction);
-    if (gama < -kEpsilon || beta + gama > 1.0f + kEpsilon) {
-      return hit_record;
-    }
-    const float t = Determinant(ba, ca, oa);
-    if (t > -kEpsilon) {
+    float beta, gama;
+    const float t = IntersectTriangle(v0, edge1, edge2, ray, beta, gama);
+    if (t != kInf) {
       hit_record.t = t;
       hit_record.normal = normal;
       hit_record.material_id = material_id;
       hit_record.texture_id = texture_id;
-      hit_record.obj = this;
       hit_record.u = ua.x + beta * (ub.x - ua.x) + gama * (uc.x - ua.x);
       hit_record.v = ua.y + beta * (ub.y - ua.y) + gama * (uc.y - ua.y);
       hit_record.intersection_point = ray.origin + ray.direction * t;
@@ -333,37 +331,53 @@ struct Face : Object {
     return hit_record;
   }
 
+  float GetDistance(const Ray& ray) const {
+    float beta, gama;
+    return IntersectTriangle(v0, edge1, edge2, ray, beta, gama);
+  }
+
   const BoundingBox GetBoundingBox() const { return bounding_box; }
 
  private:
   BoundingBox bounding_box;
-  Vec3f ba;
-  Vec3f ca;
+  Vec3f edge1;
+  Vec3f edge2;
 };  // namespace parser
 
 struct Mesh {
   int material_id;
   int texture_id;
+  std::vector<Transformation> transformations;
 
   std::vector<Face> faces;
+  // Positions in vertex_data of the vertices of every face.
+  std::vector<Vec3i> vertex_ids;
 };
 
+// Transformations are assumed to preserve orientation, the faces of the base
+// mesh are used as they are with their normals only transformed.
 struct MeshInstance {
   int material_id;
   int texture_id;
   int base_mesh_id;
-  std::vector<Face> faces;
+  std::vector<Transformation> transformations;
+  Matrix transformation;
+  Matrix inverse_transformation;
+  Matrix inverse_transformation_transpose;
 };
 
 struct Triangle {
   int material_id;
   int texture_id;
+  std::vector<Transformation> transformations;
   Face indices;
+  Vec3i vertex_ids;
 };
 
-struct Sphere : Object {
+struct Sphere final : Object {
   int material_id;
   int texture_id;
+  std::vector<Transformation> transformations;
   Matrix transformation;
   Matrix inverse_transformation;
   Matrix inverse_transformation_transpose;
@@ -378,51 +392,78 @@ struct Sphere : Object {
   HitRecord GetIntersection(const Ray& ray) const {
     HitRecord hit_record;
     hit_record.material_id = -1;
-    const Vec3f sphere_to_camera = ray.origin - center_of_sphere;
-    const float direction_times_sphere_to_camera =
-        ray.direction * sphere_to_camera;
-    const float norm_of_sphere_to_camera_squared =
-        sphere_to_camera * sphere_to_camera;
-    const float determinant =
-        direction_times_sphere_to_camera * direction_times_sphere_to_camera -
-        (norm_of_sphere_to_camera_squared - radius_squared);
-    hit_record.t = std::numeric_limits<float>::infinity();
-    if (determinant < -kEpsilon) {
+    float scale;
+    const Ray local_ray = ToObjectSpace(ray, scale);
+    const float t = GetLocalDistance(local_ray);
+    hit_record.t = t / scale;
+    if (t == kInf) {
       return hit_record;
-    } else if (determinant < kEpsilon) {
-      hit_record.t = -direction_times_sphere_to_camera;
-    } else {
-      const float t1 = (-direction_times_sphere_to_camera + sqrt(determinant));
-      const float t2 = (-direction_times_sphere_to_camera - sqrt(determinant));
-      hit_record.t = fmin(t1, t2);
-      if (t2 < .0) {
-        hit_record.t = t1;
-      } else {
-        hit_record.t = t2;
-      }
     }
+    const Vec3f local_point = local_ray.origin + local_ray.direction * t;
+    const Vec3f local_normal = GetNormal(local_point);
     hit_record.material_id = material_id;
     hit_record.texture_id = texture_id;
-    hit_record.intersection_point = ray.origin + ray.direction * hit_record.t;
-    hit_record.normal = GetNormal(hit_record.intersection_point);
-    hit_record.obj = this;
-    hit_record.u =
-        (-atan2(hit_record.normal.z, hit_record.normal.x) + M_PI) / M_PI / 2;
-    hit_record.v = acos(hit_record.normal.y) / M_PI;
+    hit_record.intersection_point = transformation * local_point;
+    hit_record.normal =
+        inverse_transformation_transpose.MultiplyVector(local_normal)
+            .Normalized();
+    hit_record.u = (-atan2(local_normal.z, local_normal.x) + M_PI) / M_PI / 2;
+    hit_record.v = acos(local_normal.y) / M_PI;
     return hit_record;
   }
 
+  float GetDistance(const Ray& ray) const {
+    float scale;
+    return GetLocalDistance(ToObjectSpace(ray, scale)) / scale;
+  }
+
   void Initialize() {
-    const Vec3f rad_vec = Vec3f(radius, radius, radius);
-    const Vec3f min_c = center_of_sphere - rad_vec;
-    const Vec3f max_c = center_of_sphere + rad_vec;
     radius_squared = radius * radius;
-    bounding_box.min_corner = min_c;
-    bounding_box.max_corner = max_c;
+    // Every axis of the box is as far from the center as the ellipsoid
+    // stretches along it, the length of the matching row of the transform.
+    const Vec3f center = transformation * center_of_sphere;
+    Vec3f extent;
+    for (int i = 0; i < 3; i++) {
+      extent[i] = radius * sqrt(transformation[i][0] * transformation[i][0] +
+                                transformation[i][1] * transformation[i][1] +
+                                transformation[i][2] * transformation[i][2]);
+    }
+    bounding_box.min_corner = center - extent;
+    bounding_box.max_corner = center + extent;
   }
 
   const BoundingBox GetBoundingBox() const { return bounding_box; }
 
+ private:
+  // Ray in object space with a normalized direction. Distances along it are
+  // scale times the ones along ray.
+  Ray ToObjectSpace(const Ray& ray, float& scale) const {
+    const Vec3f direction =
+        inverse_transformation.MultiplyVector(ray.direction);
+    scale = direction.Length();
+    return Ray{inverse_transformation * ray.origin, direction / scale,
+               ray.is_shadow};
+  }
+
+  float GetLocalDistance(const Ray& ray) const {
+    const Vec3f sphere_to_camera = ray.origin - center_of_sphere;
+    const float direction_times_sphere_to_camera =
+        ray.direction * sphere_to_camera;
+    const float norm_of_sphere_to_camera_squared =
+        sphere_to_camera * sphere_to_camera;
+    const float determinant =
+        direction_times_sphere_to_camera * direction_times_sphere_to_camera -
+        (norm_of_sphere_to_camera_squared - radius_squared);
+    if (determinant < -kEpsilon) {
+      return kInf;
+    } else if (determinant < kEpsilon) {
+      return -direction_times_sphere_to_camera;
+    }
+    const float t1 = (-direction_times_sphere_to_camera + sqrt(determinant));
+    const float t2 = (-direction_times_sphere_to_camera - sqrt(determinant));
+    return t2 < .0 ? t1 : t2;
+  }
+
   BoundingBox bounding_box;
 };
 
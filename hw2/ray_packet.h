@@ -0,0 +1,201 @@
+#ifndef _RAY_PACKET_H_
+#define _RAY_PACKET_H_
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include "bounding_volume_hierarchy.h"
+#include "wide_bvh.h"
+
+// Most rays traced together, as many as bits in the masks selecting them.
+constexpr const int kMaxPacketSize = 64;
+
+// Bounds of the rays of a packet that start at the same point and go the same
+// way along every axis. Since the distance a ray crosses a plane at is
+// monotonic in its inverse direction, the range of the inverse directions
+// bounds where any of them enters and leaves a box.
+struct PacketFrustum {
+  float origin[3];
+  float min_inv_direction[3];
+  float max_inv_direction[3];
+  int near[3];
+  int far[3];
+
+  // Returns false if the rays have no common origin or direction signs.
+  bool Init(const Ray* rays, int count) {
+    for (int i = 0; i < 3; i++) {
+      origin[i] = rays[0].origin[i];
+      min_inv_direction[i] = max_inv_direction[i] = rays[0].inv_direction[i];
+      near[i] = i + 3 * rays[0].sign[i];
+      far[i] = i + 3 * (1 - rays[0].sign[i]);
+    }
+    for (int r = 1; r < count; r++) {
+      for (int i = 0; i < 3; i++) {
+        const float inv_direction = rays[r].inv_direction[i];
+        if (rays[r].origin[i] != origin[i] ||
+            rays[r].sign[i] != rays[0].sign[i]) {
+          return false;
+        }
+        min_inv_direction[i] = std::min(min_inv_direction[i], inv_direction);
+        max_inv_direction[i] = std::max(max_inv_direction[i], inv_direction);
+      }
+    }
+    return true;
+  }
+};
+
+// Returns the bit mask of the children of node that any ray of the frustum
+// may enter before tmax.
+inline int CullChildren(const WideNode<4>& node, const PacketFrustum& frustum,
+                        float tmax) {
+  __m128 tnear = _mm_setzero_ps();
+  __m128 tfar = _mm_set1_ps(tmax);
+  for (int i = 0; i < 3; i++) {
+    const __m128 origin = _mm_set1_ps(frustum.origin[i]);
+    const __m128 min_inv = _mm_set1_ps(frustum.min_inv_direction[i]);
+    const __m128 max_inv = _mm_set1_ps(frustum.max_inv_direction[i]);
+    const __m128 near = _mm_sub_ps(_mm_load_ps(node.bounds[frustum.near[i]]),
+                                   origin);
+    const __m128 far = _mm_sub_ps(_mm_load_ps(node.bounds[frustum.far[i]]),
+                                  origin);
+    // NaNs end up as the second operand and leave the interval unchanged.
+    const __m128 tn =
+        _mm_min_ps(_mm_mul_ps(near, max_inv), _mm_mul_ps(near, min_inv));
+    const __m128 tf =
+        _mm_max_ps(_mm_mul_ps(far, max_inv), _mm_mul_ps(far, min_inv));
+    tnear = _mm_max_ps(tn, tnear);
+    tfar = _mm_min_ps(tf, tfar);
+  }
+  tfar = _mm_mul_ps(tfar, _mm_set1_ps(BoundingVolumeHierarchy::kRobustFactor));
+  return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+}
+
+__attribute__((target("avx2"))) inline int CullChildren(
+    const WideNode<8>& node, const PacketFrustum& frustum, float tmax) {
+  __m256 tnear = _mm256_setzero_ps();
+  __m256 tfar = _mm256_set1_ps(tmax);
+  for (int i = 0; i < 3; i++) {
+    const __m256 origin = _mm256_set1_ps(frustum.origin[i]);
+    const __m256 min_inv = _mm256_set1_ps(frustum.min_inv_direction[i]);
+    const __m256 max_inv = _mm256_set1_ps(frustum.max_inv_direction[i]);
+    const __m256 near = _mm256_sub_ps(
+        _mm256_load_ps(node.bounds[frustum.near[i]]), origin);
+    const __m256 far = _mm256_sub_ps(
+        _mm256_load_ps(node.bounds[frustum.far[i]]), origin);
+    const __m256 tn = _mm256_min_ps(_mm256_mul_ps(near, max_inv),
+                                    _mm256_mul_ps(near, min_inv));
+    const __m256 tf = _mm256_max_ps(_mm256_mul_ps(far, max_inv),
+                                    _mm256_mul_ps(far, min_inv));
+    tnear = _mm256_max_ps(tn, tnear);
+    tfar = _mm256_min_ps(tf, tfar);
+  }
+  tfar = _mm256_mul_ps(
+      tfar, _mm256_set1_ps(BoundingVolumeHierarchy::kRobustFactor));
+  return _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+}
+
+// Traverses the tree once for all the rays of a packet. A node is loaded and
+// culled against the frustum once, and only the rays that entered it are
+// tested against its children, each with the same slab test TraverseWide
+// does. Quantized nodes have their boxes written out once for all of them.
+// Subtrees only a single ray enters are left to TraverseWide.
+// intersect_leaf(type, first, count, mask) tests the primitives of a leaf
+// against the rays in mask and lowers their tmax.
+template <template <int> class Node, int N, typename LeafFunction>
+__attribute__((always_inline)) inline void TraversePacketWide(
+    const Node<N>* nodes, const PacketFrustum& frustum,
+    const SlabRay* rays, int count, float* tmax,
+    LeafFunction intersect_leaf) {
+  struct StackEntry {
+    int child;
+    int primitive_count;
+    int primitive_type;
+    float t;
+    uint64_t mask;
+  };
+  StackEntry stack[BoundingVolumeHierarchy::kMaxDepth * N];
+  int stack_size = 0;
+  stack[stack_size++] = {0, 0, 0, 0.f,
+                         count == kMaxPacketSize ? ~0ull : (1ull << count) - 1};
+  alignas(32) float t[N];
+  WideNode<N> decompressed;
+
+  while (stack_size > 0) {
+    const StackEntry entry = stack[--stack_size];
+    // Drop the rays which already hit something closer than the subtree.
+    uint64_t mask = 0;
+    float max_limit = -kInf;
+    for (uint64_t bits = entry.mask; bits != 0; bits &= bits - 1) {
+      const int r = __builtin_ctzll(bits);
+      const float limit = tmax[r] * BoundingVolumeHierarchy::kRobustFactor;
+      if (entry.t > limit) continue;
+      mask |= 1ull << r;
+      max_limit = std::max(max_limit, limit);
+    }
+    if (mask == 0) continue;
+    if (entry.primitive_count > 0) {
+      intersect_leaf(entry.primitive_type, entry.child, entry.primitive_count,
+                     mask);
+      continue;
+    }
+    if ((mask & (mask - 1)) == 0) {
+      const int r = __builtin_ctzll(mask);
+      TraverseWide<false>(
+          nodes, rays[r], tmax[r],
+          [&](int type, int first, int primitive_count) {
+            intersect_leaf(type, first, primitive_count, mask);
+            return false;
+          },
+          entry.child);
+      continue;
+    }
+
+    const WideNode<N>& node = Decompress(nodes[entry.child], &decompressed);
+    const int frustum_mask = CullChildren(node, frustum, max_limit);
+    if (frustum_mask == 0) continue;
+    uint64_t child_mask[N] = {};
+    float child_t[N];
+    for (int i = 0; i < N; i++) child_t[i] = kInf;
+    for (uint64_t bits = mask; bits != 0; bits &= bits - 1) {
+      const int r = __builtin_ctzll(bits);
+      const float limit = tmax[r] * BoundingVolumeHierarchy::kRobustFactor;
+      int hit = IntersectChildren(node, rays[r], limit, t) & frustum_mask;
+      while (hit != 0) {
+        const int i = __builtin_ctz(hit);
+        hit &= hit - 1;
+        child_mask[i] |= 1ull << r;
+        child_t[i] = std::min(child_t[i], t[i]);
+      }
+    }
+    // Same order as TraverseWide, by the nearest entry of any ray.
+    const int bottom = stack_size;
+    for (int i = 0; i < N; i++) {
+      if (child_mask[i] == 0) continue;
+      const StackEntry child = {node.child[i], node.primitive_count[i],
+                                node.primitive_type[i], child_t[i],
+                                child_mask[i]};
+      int j = stack_size++;
+      for (; j > bottom && stack[j - 1].t < child.t; j--) {
+        stack[j] = stack[j - 1];
+      }
+      stack[j] = child;
+    }
+  }
+}
+
+template <template <int> class Node, typename LeafFunction>
+void TraversePacket4(const Node<4>* nodes, const PacketFrustum& frustum,
+                     const SlabRay* rays, int count, float* tmax,
+                     LeafFunction intersect_leaf) {
+  TraversePacketWide(nodes, frustum, rays, count, tmax, intersect_leaf);
+}
+
+template <template <int> class Node, typename LeafFunction>
+__attribute__((target("avx2"))) void TraversePacket8(
+    const Node<8>* nodes, const PacketFrustum& frustum,
+    const SlabRay* rays, int count, float* tmax,
+    LeafFunction intersect_leaf) {
+  TraversePacketWide(nodes, frustum, rays, count, tmax, intersect_leaf);
+}
+
+#endif
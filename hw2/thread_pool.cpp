@@ -0,0 +1,100 @@
+#include "thread_pool.h"
+#include <pthread.h>
+#include <algorithm>
+
+namespace {
+
+void PinThread(pthread_t thread, int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  // Left unpinned if the cpu is not available to the process.
+  pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+}
+
+}  // namespace
+
+ThreadPool::ThreadPool(int thread_count, bool pin_threads)
+    : submitted_count_(0), stop_(false) {
+  const int cpu_count = std::max<int>(1, std::thread::hardware_concurrency());
+  if (thread_count <= 0) thread_count = cpu_count;
+  for (int i = 1; i < thread_count; i++) {
+    workers_.emplace_back(&ThreadPool::Work, this);
+    if (pin_threads) PinThread(workers_.back().native_handle(), i % cpu_count);
+  }
+  if (pin_threads) PinThread(pthread_self(), 0);
+}
+
+ThreadPool::~ThreadPool() {
+  Wait();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_available_.notify_all();
+  for (std::thread& worker : workers_) worker.join();
+}
+
+void ThreadPool::RunTask(Job* job, std::unique_lock<std::mutex>& lock) {
+  const int task = job->next++;
+  if (job->next == job->count) {
+    jobs_.erase(std::find(jobs_.begin(), jobs_.end(), job));
+  }
+  lock.unlock();
+  (*job->function)(task);
+  lock.lock();
+  if (++job->done < job->count) return;
+  if (job->function == &job->submitted) {
+    delete job;
+    submitted_count_--;
+  }
+  job_done_.notify_all();
+}
+
+void ThreadPool::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_available_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+    if (jobs_.empty()) return;
+    RunTask(jobs_.back(), lock);
+  }
+}
+
+void ThreadPool::Run(int count, const std::function<void(int)>& function) {
+  if (workers_.empty() || count <= 1) {
+    for (int i = 0; i < count; i++) function(i);
+    return;
+  }
+  Job job;
+  job.function = &function;
+  job.count = count;
+  job.next = 0;
+  job.done = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  jobs_.push_back(&job);
+  work_available_.notify_all();
+  while (job.next < job.count) RunTask(&job, lock);
+  job_done_.wait(lock, [&job] { return job.done == job.count; });
+}
+
+void ThreadPool::Submit(std::function<void()> function) {
+  if (workers_.empty()) {
+    function();
+    return;
+  }
+  Job* job = new Job;
+  job->submitted = [function](int) { function(); };
+  job->function = &job->submitted;
+  job->count = 1;
+  job->next = 0;
+  job->done = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  jobs_.push_back(job);
+  submitted_count_++;
+  work_available_.notify_one();
+}
+
+void ThreadPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  job_done_.wait(lock, [this] { return submitted_count_ == 0; });
+}
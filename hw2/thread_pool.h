@@ -0,0 +1,80 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads kept for the whole run, which the scenes are loaded, the trees built
+// and the images rendered and written on. Work is handed to them as jobs of a
+// number of tasks the threads take one at a time. The thread running a job
+// takes its tasks too and only waits for the ones already being run, so tasks
+// may run jobs of their own.
+class ThreadPool {
+ public:
+  // thread_count threads counting the one calling Run, 0 uses one per cpu.
+  // pin_threads binds every thread to a cpu of its own, the one constructing
+  // the pool to the first.
+  explicit ThreadPool(int thread_count = 0, bool pin_threads = false);
+  // Waits for the functions submitted.
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int GetThreadCount() const { return workers_.size() + 1; }
+  // Calls function(i) for every i in [0, count) and returns once all of them
+  // are done.
+  void Run(int count, const std::function<void(int)>& function);
+  // Calls function in the background, on this thread if the pool has no
+  // other.
+  void Submit(std::function<void()> function);
+  // Waits for the functions submitted so far.
+  void Wait();
+
+ private:
+  struct Job {
+    const std::function<void(int)>* function;
+    int count;
+    // Tasks taken so far and tasks done.
+    int next;
+    int done;
+    // Function of a submitted job, which is deleted once it is done.
+    std::function<void(int)> submitted;
+  };
+
+  void Work();
+  // Runs the next task of job with lock released, job must have one left.
+  void RunTask(Job* job, std::unique_lock<std::mutex>& lock);
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable job_done_;
+  // Jobs with tasks left to take. The last one is taken from first, so that
+  // the jobs run from tasks are finished before more tasks are started.
+  std::vector<Job*> jobs_;
+  int submitted_count_;
+  bool stop_;
+};
+
+// Splits [begin, end) into thread_count chunks and calls
+// function(chunk, chunk_begin, chunk_end) for each on the threads of
+// thread_pool, or one after another if it is nullptr.
+template <typename Function>
+void ParallelFor(int begin, int end, ThreadPool* thread_pool, int thread_count,
+                 Function function) {
+  const long long size = end - begin;
+  const auto run_chunk = [&](int chunk) {
+    function(chunk, begin + size * chunk / thread_count,
+             begin + size * (chunk + 1) / thread_count);
+  };
+  if (thread_pool == nullptr) {
+    for (int chunk = 0; chunk < thread_count; chunk++) run_chunk(chunk);
+  } else {
+    thread_pool->Run(thread_count, run_chunk);
+  }
+}
+
+#endif
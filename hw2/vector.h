@@ -5,6 +5,7 @@
 #include <iostream>
 #include <limits>
 #include <vector>
+#include "arena.h"
 
 constexpr const float kInf = std::numeric_limits<float>::infinity();
 constexpr const float kEpsilon = 1e-6;
@@ -148,6 +149,11 @@ struct Rotation;
 struct MeshInstance;
 
 struct Scene {
+  // Holds what is made for the scene besides its vectors, such as the
+  // textures, and frees all of it along with the scene. The trees over it are
+  // kept by SceneRenderer, which replaces them as the scene moves.
+  Arena arena;
+
   // Data
   Vec3i background_color;
   float shadow_ray_epsilon;
@@ -169,6 +175,10 @@ struct Scene {
 
   // Functions
   void loadFromXml(const std::string& filepath);
+  // Places the faces, spheres and mesh instances by their transformations,
+  // which is done again whenever the scalings, translations or rotations
+  // change.
+  void ApplyTransformations();
 };
 
 struct Matrix {
@@ -0,0 +1,175 @@
+#include "wide_bvh.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "bvh_builder.h"
+
+namespace {
+
+// Plane of a quantized box, computed the same way as the slab tests do.
+float Dequantize(float origin, float scale, int step) {
+  return origin + step * scale;
+}
+
+}  // namespace
+
+template <int N>
+void StoreNode(const WideNode<N>& node, WideNode<N>& stored) {
+  stored = node;
+}
+
+template <int N>
+void StoreNode(const WideNode<N>& node, QuantizedWideNode<N>& quantized) {
+  for (int j = 0; j < 3; j++) {
+    float min = kInf, max = -kInf;
+    for (int i = 0; i < N; i++) {
+      if (node.bounds[j][i] > node.bounds[j + 3][i]) continue;
+      min = std::min(min, node.bounds[j][i]);
+      max = std::max(max, node.bounds[j + 3][i]);
+    }
+    // The smallest power of two whose 254 steps span the children, leaving
+    // a step to spare for the rounding of the planes near the maximum.
+    int exponent;
+    std::frexp((max - min) / 254, &exponent);
+    quantized.origin[j] = min;
+    quantized.scale[j] =
+        std::max(std::ldexp(1.f, exponent), std::numeric_limits<float>::min());
+  }
+
+  for (int i = 0; i < N; i++) {
+    quantized.child[i] = node.child[i];
+    quantized.primitive_count[i] = node.primitive_count[i];
+    quantized.primitive_type[i] = node.primitive_type[i];
+    for (int j = 0; j < 3; j++) {
+      const float origin = quantized.origin[j];
+      const float scale = quantized.scale[j];
+      const float min = node.bounds[j][i];
+      const float max = node.bounds[j + 3][i];
+      if (min > max) {
+        quantized.bounds[j][i] = 255;
+        quantized.bounds[j + 3][i] = 0;
+        continue;
+      }
+      // Step 0 is the origin itself and step 255 lies beyond the maximum of
+      // all children, so stepping outwards ends with a box enclosing min and
+      // max.
+      int low = std::max(0.f, std::floor((min - origin) / scale));
+      while (low > 0 && Dequantize(origin, scale, low) > min) low--;
+      int high = std::min(255.f, std::ceil((max - origin) / scale));
+      while (high < 255 && Dequantize(origin, scale, high) < max) high++;
+      quantized.bounds[j][i] = low;
+      quantized.bounds[j + 3][i] = high;
+    }
+  }
+}
+
+namespace {
+
+template <template <int> class Node, int N>
+int Collapse(const std::vector<BuildNode>& build_nodes, int idx,
+             Node<N>* nodes, int& offset) {
+  const int cur = offset++;
+
+  // Keep opening the interior child with the largest surface area until the
+  // node is full, pulling its children up a level.
+  int children[N];
+  int child_count = 0;
+  const BuildNode& root = build_nodes[idx];
+  if (root.left == -1) {
+    children[child_count++] = idx;
+  } else {
+    children[child_count++] = root.left;
+    children[child_count++] = root.right;
+  }
+  while (child_count < N) {
+    int largest = -1;
+    float largest_area = -1;
+    for (int i = 0; i < child_count; i++) {
+      const BuildNode& child = build_nodes[children[i]];
+      const float area = child.bounding_box.GetSurfaceArea();
+      if (child.left != -1 && area > largest_area) {
+        largest = i;
+        largest_area = area;
+      }
+    }
+    if (largest == -1) break;
+    const BuildNode& child = build_nodes[children[largest]];
+    children[largest] = child.left;
+    children[child_count++] = child.right;
+  }
+
+  int child_offsets[N];
+  for (int i = 0; i < child_count; i++) {
+    const BuildNode& child = build_nodes[children[i]];
+    if (child.left != -1) {
+      child_offsets[i] = Collapse(build_nodes, children[i], nodes, offset);
+    }
+  }
+  if (nodes == nullptr) return cur;
+
+  WideNode<N> node;
+  for (int i = 0; i < N; i++) {
+    if (i >= child_count) {
+      for (int j = 0; j < 3; j++) {
+        node.bounds[j][i] = kInf;
+        node.bounds[j + 3][i] = -kInf;
+      }
+      node.child[i] = -1;
+      node.primitive_count[i] = 0;
+      node.primitive_type[i] = 0;
+      continue;
+    }
+    const BuildNode& child = build_nodes[children[i]];
+    for (int j = 0; j < 3; j++) {
+      node.bounds[j][i] = child.bounding_box.min_corner[j];
+      node.bounds[j + 3][i] = child.bounding_box.max_corner[j];
+    }
+    if (child.left == -1) {
+      node.child[i] = child.start;
+      node.primitive_count[i] = child.end - child.start;
+      node.primitive_type[i] = child.primitive_type;
+    } else {
+      node.child[i] = child_offsets[i];
+      node.primitive_count[i] = 0;
+      node.primitive_type[i] = 0;
+    }
+  }
+  StoreNode(node, nodes[cur]);
+  return cur;
+}
+
+}  // namespace
+
+int GetNativeNodeWidth() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? 8 : 4;
+}
+
+template <template <int> class Node, int N>
+int CollapseTree(const std::vector<BuildNode>& build_nodes, Node<N>* nodes) {
+  int offset = 0;
+  Collapse(build_nodes, 0, nodes, offset);
+  return offset;
+}
+
+template <int N>
+int CountWideNodes(const std::vector<BuildNode>& build_nodes) {
+  return CollapseTree(build_nodes, static_cast<WideNode<N>*>(nullptr));
+}
+
+template int CollapseTree(const std::vector<BuildNode>& build_nodes,
+                          WideNode<4>* nodes);
+template int CollapseTree(const std::vector<BuildNode>& build_nodes,
+                          WideNode<8>* nodes);
+template int CollapseTree(const std::vector<BuildNode>& build_nodes,
+                          QuantizedWideNode<4>* nodes);
+template int CollapseTree(const std::vector<BuildNode>& build_nodes,
+                          QuantizedWideNode<8>* nodes);
+template void StoreNode(const WideNode<4>& node, WideNode<4>& stored);
+template void StoreNode(const WideNode<8>& node, WideNode<8>& stored);
+template void StoreNode(const WideNode<4>& node,
+                        QuantizedWideNode<4>& quantized);
+template void StoreNode(const WideNode<8>& node,
+                        QuantizedWideNode<8>& quantized);
+template int CountWideNodes<4>(const std::vector<BuildNode>& build_nodes);
+template int CountWideNodes<8>(const std::vector<BuildNode>& build_nodes);
@@ -0,0 +1,266 @@
+#ifndef _WIDE_BVH_H_
+#define _WIDE_BVH_H_
+
+#include <immintrin.h>
+#include <cstring>
+#include <vector>
+#include "bounding_volume_hierarchy.h"
+
+struct BuildNode;
+
+// Node with up to N children whose boxes are stored as structure of arrays,
+// bounds[0..2] hold the minimum and bounds[3..5] the maximum x, y, z of every
+// child so that a ray is tested against all of them with one SIMD slab test.
+// A child with a non zero primitive_count is a leaf whose primitives start at
+// child[i] in the array of primitive_type[i]. Unused slots have an empty box
+// which no ray can hit.
+template <int N>
+struct alignas(32) WideNode {
+  float bounds[6][N];
+  int child[N];
+  unsigned short primitive_count[N];
+  unsigned short primitive_type[N];
+};
+
+// WideNode whose child boxes are stored in 8 bits per plane, as steps of
+// scale[j] from origin[j] along each axis, which halves the size of a node.
+// The steps are powers of two and the planes are rounded outwards, so the
+// boxes only grow. Unused slots have a minimum above their maximum.
+template <int N>
+struct alignas(16) QuantizedWideNode {
+  float origin[3];
+  float scale[3];
+  unsigned char bounds[6][N];
+  int child[N];
+  unsigned short primitive_count[N];
+  unsigned char primitive_type[N];
+};
+
+// Ray prepared for the slab tests, near[i] is the index into bounds of the
+// plane a ray going in its direction enters the box through.
+struct SlabRay {
+  float origin[3];
+  float inv_direction[3];
+  int near[3];
+  int far[3];
+
+  SlabRay() = default;
+  explicit SlabRay(const Ray& ray) {
+    for (int i = 0; i < 3; i++) {
+      origin[i] = ray.origin[i];
+      inv_direction[i] = ray.inv_direction[i];
+      near[i] = i + 3 * ray.sign[i];
+      far[i] = i + 3 * (1 - ray.sign[i]);
+    }
+  }
+};
+
+// Widest node the cpu has vector instructions for, 8 with AVX2 and 4 otherwise.
+int GetNativeNodeWidth();
+
+// Collapses the binary tree rooted at the first of build_nodes into nodes of
+// width N in depth first order and returns the number of nodes, which
+// CountWideNodes computes without writing them.
+template <template <int> class Node, int N>
+int CollapseTree(const std::vector<BuildNode>& build_nodes, Node<N>* nodes);
+template <int N>
+int CountWideNodes(const std::vector<BuildNode>& build_nodes);
+
+// Writes node to stored, quantizing its boxes for a QuantizedWideNode.
+template <int N>
+void StoreNode(const WideNode<N>& node, WideNode<N>& stored);
+template <int N>
+void StoreNode(const WideNode<N>& node, QuantizedWideNode<N>& quantized);
+
+// Returns node, or for a quantized one its boxes written out to decompressed.
+template <int N>
+const WideNode<N>& Decompress(const WideNode<N>& node, WideNode<N>*) {
+  return node;
+}
+
+template <int N>
+const WideNode<N>& Decompress(const QuantizedWideNode<N>& node,
+                              WideNode<N>* decompressed) {
+  for (int j = 0; j < 6; j++) {
+    for (int i = 0; i < N; i++) {
+      decompressed->bounds[j][i] =
+          node.origin[j % 3] + node.bounds[j][i] * node.scale[j % 3];
+    }
+  }
+  for (int i = 0; i < N; i++) {
+    decompressed->child[i] = node.child[i];
+    decompressed->primitive_count[i] = node.primitive_count[i];
+    decompressed->primitive_type[i] = node.primitive_type[i];
+  }
+  return *decompressed;
+}
+
+// Tests the ray against every child of node and returns the bit mask of the
+// ones entered before tmax, their entry distances are written to t.
+inline int IntersectChildren(const WideNode<4>& node, const SlabRay& ray,
+                             float tmax, float* t) {
+  __m128 tnear = _mm_setzero_ps();
+  __m128 tfar = _mm_set1_ps(tmax);
+  for (int i = 0; i < 3; i++) {
+    const __m128 origin = _mm_set1_ps(ray.origin[i]);
+    const __m128 inv_direction = _mm_set1_ps(ray.inv_direction[i]);
+    const __m128 near = _mm_load_ps(node.bounds[ray.near[i]]);
+    const __m128 far = _mm_load_ps(node.bounds[ray.far[i]]);
+    // A NaN from a ray lying in a slab plane leaves the interval unchanged,
+    // as max and min return their second operand when either is NaN.
+    tnear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near, origin), inv_direction),
+                       tnear);
+    tfar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far, origin), inv_direction), tfar);
+  }
+  _mm_store_ps(t, tnear);
+  tfar = _mm_mul_ps(tfar, _mm_set1_ps(BoundingVolumeHierarchy::kRobustFactor));
+  return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+}
+
+__attribute__((target("avx2"))) inline int IntersectChildren(
+    const WideNode<8>& node, const SlabRay& ray, float tmax, float* t) {
+  __m256 tnear = _mm256_setzero_ps();
+  __m256 tfar = _mm256_set1_ps(tmax);
+  for (int i = 0; i < 3; i++) {
+    const __m256 origin = _mm256_set1_ps(ray.origin[i]);
+    const __m256 inv_direction = _mm256_set1_ps(ray.inv_direction[i]);
+    const __m256 near = _mm256_load_ps(node.bounds[ray.near[i]]);
+    const __m256 far = _mm256_load_ps(node.bounds[ray.far[i]]);
+    tnear = _mm256_max_ps(
+        _mm256_mul_ps(_mm256_sub_ps(near, origin), inv_direction), tnear);
+    tfar = _mm256_min_ps(
+        _mm256_mul_ps(_mm256_sub_ps(far, origin), inv_direction), tfar);
+  }
+  _mm256_store_ps(t, tnear);
+  tfar = _mm256_mul_ps(
+      tfar, _mm256_set1_ps(BoundingVolumeHierarchy::kRobustFactor));
+  return _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+}
+
+// Same for quantized nodes, whose planes are computed the way QuantizeNodes
+// checked them to enclose the children.
+inline int IntersectChildren(const QuantizedWideNode<4>& node,
+                             const SlabRay& ray, float tmax, float* t) {
+  __m128 tnear = _mm_setzero_ps();
+  __m128 tfar = _mm_set1_ps(tmax);
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = 0; i < 3; i++) {
+    const __m128 origin = _mm_set1_ps(node.origin[i]);
+    const __m128 scale = _mm_set1_ps(node.scale[i]);
+    const __m128 ray_origin = _mm_set1_ps(ray.origin[i]);
+    const __m128 inv_direction = _mm_set1_ps(ray.inv_direction[i]);
+    int near_bytes, far_bytes;
+    memcpy(&near_bytes, node.bounds[ray.near[i]], 4);
+    memcpy(&far_bytes, node.bounds[ray.far[i]], 4);
+    const __m128i near_steps = _mm_unpacklo_epi16(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(near_bytes), zero), zero);
+    const __m128i far_steps = _mm_unpacklo_epi16(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(far_bytes), zero), zero);
+    const __m128 near =
+        _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(near_steps), scale));
+    const __m128 far =
+        _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(far_steps), scale));
+    tnear = _mm_max_ps(
+        _mm_mul_ps(_mm_sub_ps(near, ray_origin), inv_direction), tnear);
+    tfar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far, ray_origin), inv_direction),
+                      tfar);
+  }
+  _mm_store_ps(t, tnear);
+  tfar = _mm_mul_ps(tfar, _mm_set1_ps(BoundingVolumeHierarchy::kRobustFactor));
+  return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+}
+
+__attribute__((target("avx2"))) inline int IntersectChildren(
+    const QuantizedWideNode<8>& node, const SlabRay& ray, float tmax,
+    float* t) {
+  __m256 tnear = _mm256_setzero_ps();
+  __m256 tfar = _mm256_set1_ps(tmax);
+  for (int i = 0; i < 3; i++) {
+    const __m256 origin = _mm256_set1_ps(node.origin[i]);
+    const __m256 scale = _mm256_set1_ps(node.scale[i]);
+    const __m256 ray_origin = _mm256_set1_ps(ray.origin[i]);
+    const __m256 inv_direction = _mm256_set1_ps(ray.inv_direction[i]);
+    const __m256i near_steps = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+        reinterpret_cast<const __m128i*>(node.bounds[ray.near[i]])));
+    const __m256i far_steps = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+        reinterpret_cast<const __m128i*>(node.bounds[ray.far[i]])));
+    const __m256 near = _mm256_add_ps(
+        origin, _mm256_mul_ps(_mm256_cvtepi32_ps(near_steps), scale));
+    const __m256 far = _mm256_add_ps(
+        origin, _mm256_mul_ps(_mm256_cvtepi32_ps(far_steps), scale));
+    tnear = _mm256_max_ps(
+        _mm256_mul_ps(_mm256_sub_ps(near, ray_origin), inv_direction), tnear);
+    tfar = _mm256_min_ps(
+        _mm256_mul_ps(_mm256_sub_ps(far, ray_origin), inv_direction), tfar);
+  }
+  _mm256_store_ps(t, tnear);
+  tfar = _mm256_mul_ps(
+      tfar, _mm256_set1_ps(BoundingVolumeHierarchy::kRobustFactor));
+  return _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+}
+
+// Visits the leaves of the subtree at root that the ray enters no later than
+// tmax, nearest child first unless kAnyHit is set. intersect_leaf(type, first,
+// count) tests the primitives of a leaf, may lower tmax and returns true to
+// end the traversal.
+template <bool kAnyHit, template <int> class Node, int N,
+          typename LeafFunction>
+__attribute__((always_inline)) inline void TraverseWide(
+    const Node<N>* nodes, const SlabRay& ray, const float& tmax,
+    LeafFunction intersect_leaf, int root = 0) {
+  struct StackEntry {
+    int child;
+    int primitive_count;
+    int primitive_type;
+    float t;
+  };
+  StackEntry stack[BoundingVolumeHierarchy::kMaxDepth * N];
+  int stack_size = 0;
+  stack[stack_size++] = {root, 0, 0, 0.f};
+  alignas(32) float t[N];
+
+  while (stack_size > 0) {
+    const StackEntry entry = stack[--stack_size];
+    const float limit = tmax * BoundingVolumeHierarchy::kRobustFactor;
+    if (entry.t > limit) continue;
+    if (entry.primitive_count > 0) {
+      if (intersect_leaf(entry.primitive_type, entry.child,
+                         entry.primitive_count)) {
+        return;
+      }
+      continue;
+    }
+
+    const Node<N>& node = nodes[entry.child];
+    int mask = IntersectChildren(node, ray, limit, t);
+    // Insert the hit children so that the nearest one ends up on top. Any
+    // hit will do for occlusion, which is not worth sorting for.
+    const int bottom = stack_size;
+    while (mask != 0) {
+      const int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+      const StackEntry child = {node.child[i], node.primitive_count[i],
+                                node.primitive_type[i], t[i]};
+      int j = stack_size++;
+      for (; !kAnyHit && j > bottom && stack[j - 1].t < child.t; j--) {
+        stack[j] = stack[j - 1];
+      }
+      stack[j] = child;
+    }
+  }
+}
+
+template <bool kAnyHit, template <int> class Node, typename LeafFunction>
+void TraverseBvh4(const Node<4>* nodes, const SlabRay& ray,
+                  const float& tmax, LeafFunction intersect_leaf) {
+  TraverseWide<kAnyHit>(nodes, ray, tmax, intersect_leaf);
+}
+
+template <bool kAnyHit, template <int> class Node, typename LeafFunction>
+__attribute__((target("avx2"))) void TraverseBvh8(
+    const Node<8>* nodes, const SlabRay& ray, const float& tmax,
+    LeafFunction intersect_leaf) {
+  TraverseWide<kAnyHit>(nodes, ray, tmax, intersect_leaf);
+}
+
+#endif